@@ -0,0 +1,122 @@
+#!/bin/sh
+#
+# Benchmark of the lrtm_count_distinct aggregates, compared to the core
+# count(DISTINCT). Connects using the usual libpq environment (PGDATABASE,
+# PGHOST, ...), the extension SQL needs to be loaded in the database.
+#
+#   ROWS=10000000 RUNS=3 WORKERS="0 2 4 8" bench/run.sh [pattern]
+#
+# ROWS     - number of rows in the benchmark tables (default 10M)
+# RUNS     - runs of each query, the best one is reported (default 3)
+# WORKERS  - max_parallel_workers_per_gather values to test (default "0 2 4 8")
+# SETUP    - set to 0 to reuse the tables from the previous run
+#
+# Only cases with names matching the (grep) pattern are executed. For each
+# case and number of workers, the output line has the execution time (ms),
+# input rows per second, the peak memory of the aggregate context (kB), and
+# the number of compactions (both from lrtm_count_distinct_stats, only in the
+# leader process). The core aggregates don't report the memory of the
+# aggregate context, so for them it's the memory used by hash aggregates
+# (from EXPLAIN ANALYZE, "-" for other plans).
+
+ROWS=${ROWS:-10000000}
+RUNS=${RUNS:-3}
+WORKERS=${WORKERS:-"0 2 4 8"}
+SETUP=${SETUP:-1}
+PATTERN=${1:-.}
+
+DIR=$(dirname "$0")
+PSQL="psql -X -q -v ON_ERROR_STOP=1"
+
+# name | lrtm_count_distinct query | core query (empty - no equivalent)
+CASES='
+int8-all-sorted|SELECT lrtm_count_distinct(all8) FROM bench_sorted|SELECT count(DISTINCT all8) FROM bench_sorted
+int8-all-random|SELECT lrtm_count_distinct(all8) FROM bench_random|SELECT count(DISTINCT all8) FROM bench_random
+int8-1pct-random|SELECT lrtm_count_distinct(pct8) FROM bench_random|SELECT count(DISTINCT pct8) FROM bench_random
+int8-0.01pct-random|SELECT lrtm_count_distinct(rare8) FROM bench_random|SELECT count(DISTINCT rare8) FROM bench_random
+int4-all-sorted|SELECT lrtm_count_distinct(all4) FROM bench_sorted|SELECT count(DISTINCT all4) FROM bench_sorted
+int4-all-random|SELECT lrtm_count_distinct(all4) FROM bench_random|SELECT count(DISTINCT all4) FROM bench_random
+int4-1pct-random|SELECT lrtm_count_distinct(pct4) FROM bench_random|SELECT count(DISTINCT pct4) FROM bench_random
+int4-0.01pct-random|SELECT lrtm_count_distinct(rare4) FROM bench_random|SELECT count(DISTINCT rare4) FROM bench_random
+pair-int4-int8-random|SELECT lrtm_count_distinct(pct4, rare8) FROM bench_random|SELECT count(DISTINCT (pct4, rare8)) FROM bench_random
+groups-sorted|SELECT grp, lrtm_count_distinct(pct8) FROM bench_sorted GROUP BY grp|SELECT grp, count(DISTINCT pct8) FROM bench_sorted GROUP BY grp
+groups-random|SELECT grp, lrtm_count_distinct(pct8) FROM bench_random GROUP BY grp|SELECT grp, count(DISTINCT pct8) FROM bench_random GROUP BY grp
+groups-grouped-random|SELECT count(*) FROM unnest((SELECT lrtm_count_distinct_grouped(grp, pct8) FROM bench_random))|SELECT count(*) FROM (SELECT grp, count(DISTINCT pct8) FROM bench_random GROUP BY grp) s
+array-elements|SELECT lrtm_count_distinct_elements(arr) FROM bench_random|SELECT count(DISTINCT e) FROM bench_random, unnest(arr) e
+array-agg-1pct|SELECT array_length(lrtm_array_agg_distinct(pct8), 1) FROM bench_random|SELECT array_length(array_agg(DISTINCT pct8), 1) FROM bench_random
+approx-all|SELECT lrtm_count_distinct_approx(all8) FROM bench_random|
+hybrid-all|SELECT (lrtm_count_distinct_hybrid(all8)).count FROM bench_random|
+'
+
+if [ "$SETUP" != "0" ]; then
+    echo "loading $ROWS rows ..." >&2
+    $PSQL -v rows="$ROWS" -f "$DIR/setup.sql" || exit 1
+fi
+
+# best execution time (ms), max aggregate memory (kB) and compactions
+measure() {
+    workers=$1
+    query=$2
+    best=""
+    mem="-"
+    compactions="-"
+
+    i=0
+    while [ $i -lt "$RUNS" ]; do
+        out=$($PSQL -At <<EOF
+SET max_parallel_workers_per_gather = $workers;
+SET parallel_setup_cost = 0;
+SET parallel_tuple_cost = 0;
+SET min_parallel_table_scan_size = 0;
+SET lrtm_count_distinct.track_stats = on;
+SELECT lrtm_count_distinct_stats_reset();
+EXPLAIN (ANALYZE, TIMING OFF) $query;
+SELECT 'compactions: ' || compactions FROM lrtm_count_distinct_stats();
+SELECT 'context: ' || peak_context_bytes / 1024 FROM lrtm_count_distinct_stats();
+EOF
+)
+        if [ $? -ne 0 ]; then
+            echo "query failed: $query" >&2
+            return 1
+        fi
+
+        ms=$(echo "$out" | sed -n 's/.*Execution Time: \([0-9.]*\) ms.*/\1/p')
+        compactions=$(echo "$out" | sed -n 's/^compactions: //p')
+
+        case "$query" in
+            *lrtm_*) kb=$(echo "$out" | sed -n 's/^context: //p') ;;
+            *) kb=$(echo "$out" | sed -n 's/.*Memory Usage: \([0-9]*\)kB.*/\1/p' | sort -n | tail -1) ;;
+        esac
+
+        best=$(echo "$ms $best" | awk '{ print ($2 == "" || $1 < $2) ? $1 : $2 }')
+
+        [ -n "$kb" ] && mem=$kb
+
+        i=$((i + 1))
+    done
+
+    # the core aggregates don't compact anything
+    case "$query" in
+        *lrtm_*) ;;
+        *) compactions="-" ;;
+    esac
+
+    echo "$best $mem $compactions"
+}
+
+printf "%-22s %-8s %-20s %12s %14s %10s %12s\n" case workers aggregate ms rows/s mem_kb compactions
+
+echo "$CASES" | grep -v '^$' | grep -e "$PATTERN" | while IFS='|' read -r name lrtm core; do
+    for w in $WORKERS; do
+        for agg in lrtm core; do
+            if [ "$agg" = "lrtm" ]; then query=$lrtm; else query=$core; fi
+            [ -z "$query" ] && continue
+
+            result=$(measure "$w" "$query") || exit 1
+            set -- $result
+            rate=$(echo "$ROWS $1" | awk '{ printf "%d", $1 * 1000 / $2 }')
+
+            printf "%-22s %-8s %-20s %12s %14s %10s %12s\n" "$name" "$w" "$agg" "$1" "$rate" "$2" "$3"
+        done
+    done
+done
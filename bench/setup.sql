@@ -0,0 +1,35 @@
+/*
+ * Data for the lrtm_count_distinct benchmarks (see bench/run.sh). Expects
+ * the psql variable "rows", and the extension SQL already loaded.
+ *
+ * Columns of bench_sorted / bench_random (same data, the second table in
+ * random order):
+ *
+ *   all8, all4      - all values distinct
+ *   pct8, pct4      - 1% distinct values (each value ~100x)
+ *   rare8, rare4    - 0.01% distinct values (each value ~10000x)
+ *   grp             - group key for GROUP BY (~100 rows per group)
+ *   arr             - int4[] with 10 elements (~10% distinct)
+ */
+
+DROP TABLE IF EXISTS bench_sorted;
+DROP TABLE IF EXISTS bench_random;
+
+CREATE TABLE bench_sorted AS
+SELECT i::int8                                 AS all8,
+       i::int4                                 AS all4,
+       (i % greatest(:rows / 100, 1))::int8    AS pct8,
+       (i % greatest(:rows / 100, 1))::int4    AS pct4,
+       (i % greatest(:rows / 10000, 1))::int8  AS rare8,
+       (i % greatest(:rows / 10000, 1))::int4  AS rare4,
+       (i / 100)::int4                         AS grp,
+       ARRAY(SELECT ((i * 10 + j) % greatest(:rows, 1))::int4
+               FROM generate_series(0, 9) j)   AS arr
+  FROM generate_series(0, :rows - 1) i
+ ORDER BY i;
+
+CREATE TABLE bench_random AS
+SELECT * FROM bench_sorted ORDER BY random();
+
+VACUUM ANALYZE bench_sorted;
+VACUUM ANALYZE bench_random;
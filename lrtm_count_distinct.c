@@ -16,16 +16,45 @@
 #include "utils/builtins.h"
 #include "catalog/pg_type.h"
 #include "nodes/execnodes.h"
+#include "nodes/plannodes.h"
 #include "access/tupmacs.h"
 #include "utils/pg_crc.h"
+#include "port/pg_bitutils.h"
+#include "port/pg_bswap.h"
+#include "utils/guc.h"
+#include "funcapi.h"
+#include "access/htup_details.h"
+#include "access/nbtree.h"
+#include "access/transam.h"
+#include "access/xact.h"
+#include "utils/typcache.h"
+#include "libpq/pqformat.h"
+#include "miscadmin.h"
+#include "storage/buffile.h"
+#include "commands/tablespace.h"
+
+/*
+ * SIMD kernels removing duplicates from sorted 4/8B items. AVX2 is checked
+ * at runtime (see choose_dedup_kernels), NEON is part of the aarch64 baseline.
+ */
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define USE_AVX2_DEDUP
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define USE_NEON_DEDUP
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define PREFETCH_READ(ptr)  __builtin_prefetch((ptr), 0, 0)
+#else
+#define PREFETCH_READ(ptr)  ((void) 0)
+#endif
 
 #ifdef PG_MODULE_MAGIC
 PG_MODULE_MAGIC;
 #endif
 
-/* if set to 1, the table resize will be profiled */
-#define DEBUG_PROFILE       0
-
 #define GET_AGG_CONTEXT(fname, fcinfo, aggcontext)  \
     if (! AggCheckCallContext(fcinfo, &aggcontext)) {   \
         elog(ERROR, "%s called in non-aggregate context", fname);  \
@@ -37,9 +66,115 @@ PG_MODULE_MAGIC;
     }
 
 #define ARRAY_INIT_SIZE     32      /* initial size of the array (in bytes) */
+#define SET_INLINE_BYTES    32      /* sets up to this size are stored in the header */
 #define ARRAY_FREE_FRACT    0.2     /* we want >= 20% free space after compaction */
+#define SCRATCH_KEEP_FRACT  0.5     /* keep scratch buffers up to 50% of the array */
+#define ARRAY_FEW_DUPS_FRACT 0.1    /* compaction removing < 10% of the tail is not worth it */
+
+#define INITIAL_BYTES_AUTO  (-1)    /* lrtm_count_distinct.initial_bytes default */
+#define AUTO_INIT_MAX_BYTES (64 * 1024) /* upper limit for sizes derived from estimates */
+#define AUTO_INIT_MAX_GROUPS 64         /* estimates for more groups are not used at all */
+#define AUTO_INIT_GROUP_BYTES (4 * 1024) /* upper limit with grouping (per group) */
+
+#define RADIX_SORT_MIN_ITEMS    64  /* shorter runs are sorted by insertion sort */
+#define RADIX_BLOCK_BYTES   (256 * 1024)    /* larger runs get partitioned first, to sort in cache */
+#define PREFETCH_DISTANCE   512     /* merges prefetch the runs this many bytes ahead */
+
+#define GROUPED_INIT_PAIRS      8192    /* initial size of the grouped state (pairs) */
+#define GROUPED_PARTITION_PAIRS 16384   /* pairs per partition (256kB, to sort in cache) */
+#define GROUPED_MAX_PARTITIONS  1024    /* more would thrash the TLB when partitioning */
+
+#define HASH_MAX_FILL           0.7     /* grow the hash table when fuller than this */
+#define HASH_MIN_SWITCH_ITEMS   1024    /* never leave the hash mode with fewer items */
+#define HASH_MAX_NEW_FRACT      0.5     /* switch to sorted array when more new items */
+
+#define BITMAP_MAX_FRACT        0.5     /* switch to bitmap when it's this fraction of the array */
+
+#define GALLOP_MIN_RATIO        32      /* search the larger set when this much larger */
+
+#define COUNTED_INIT_SLOTS      64      /* initial size of the moving-aggregate hash table */
+
+#define SPILL_BYTES_WORK_MEM    (-1)    /* lrtm_count_distinct.spill_bytes default */
+#define SPILL_MIN_BYTES         (64 * 1024) /* never spill sets smaller than this */
+#define SPILL_MERGE_FANIN       16      /* merge this many spilled runs of the same level */
+#define SPILL_CHUNK_BYTES       (4 * BLCKSZ)    /* read/write buffer for spilled runs */
+
+/* representation of the set */
+#define SET_MODE_ARRAY      0   /* sorted part + unsorted part (data array) */
+#define SET_MODE_HASH       1   /* linear-probing hash table (data array) */
+#define SET_MODE_SKETCH     2   /* HyperLogLog registers (data array), not exact */
+#define SET_MODE_BITMAP     3   /* one bit per key from base (data array of uint64 words) */
+
+/* default for lrtm_count_distinct.max_exact_bytes */
+#define DEFAULT_MAX_EXACT_BYTES     (1024 * 1024)
+
+struct element_set_t;
+
+/* sorting kernel, picked by item_size in init_set() */
+typedef void (*sort_items_fn) (struct element_set_t * eset, char * data, int nitems);
+
+/* removes duplicates from sorted items (in place), returns the number of items left */
+typedef int (*dedup_items_fn) (char * data, int nitems);
+
+#define HLL_MIN_PRECISION       4
+#define HLL_MAX_PRECISION       18
+#define HLL_DEFAULT_PRECISION   14      /* 16k registers, ~0.8% standard error */
+
+/* how the values are stored as set items */
+#define VALUE_BYVAL         0   /* the value itself (passed by value) */
+#define VALUE_BYREF         1   /* the value itself (fixed-length, by reference) */
+#define VALUE_FINGERPRINT   2   /* 64-bit hash of the value */
+
+/*
+ * How by-value items are ordered. The items are compared as unsigned integers
+ * (see compare_values), so signed integers and floats are stored as keys that
+ * compare the same way as the values - signed integers with the sign bit
+ * flipped, floats with the sign bit flipped for positive values and all bits
+ * flipped for negative ones. The sorted sets (and arrays built from them)
+ * are then in value order. Floats are canonicalized first, so that -0.0 and
+ * 0.0 (and all the NaNs) are the same item, just like for the equality.
+ */
+#define VALUE_ORDER_UNSIGNED    0   /* the bytes as they are (e.g. oid, bool) */
+#define VALUE_ORDER_SIGNED      1   /* int2, int4, int8, date, time, timestamp, money */
+#define VALUE_ORDER_FLOAT       2   /* float4, float8 */
+
+/* mask for the bits of a by-value item of the given width */
+#define ITEM_MASK(width)    (((width) == 8) ? ~UINT64CONST(0) : ((UINT64CONST(1) << (8 * (width))) - 1))
+
+/*
+ * Type of the aggregated values, and how to turn them into fixed-width items.
+ * Values passed by reference are kept as is only when they are fixed-length
+ * and equal values are guaranteed to be binary equal (btree equalimage), so
+ * that comparing the bytes gives the same answer as the equality operator.
+ * Otherwise the items are 64-bit fingerprints, computed either from the
+ * bytes (equalimage types, e.g. text with a deterministic collation) or by
+ * the type's extended hash function (e.g. numeric, where 1.0 = 1.00). With
+ * n distinct values the chance of a fingerprint collision is about
+ * n^2 / 2^65, i.e. negligible even for hundreds of millions of values.
+ */
+typedef struct value_type_t {
+
+    int16   typlen;
+    bool    typbyval;
+    char    typalign;
+
+    uint8   kind;       /* VALUE_BYVAL, VALUE_BYREF or VALUE_FINGERPRINT */
+    uint8   order;      /* VALUE_ORDER_* (by-value items only) */
 
-/* A hash table - a collection of buckets. */
+    /* base type of the values (InvalidOid - unknown, e.g. old stored sets) */
+    Oid         typid;
+
+    /* extended hash function and collation (NULL - hash the bytes) */
+    FmgrInfo   *hash_proc;
+    Oid         collation;
+
+} value_type_t;
+
+/*
+ * A set of distinct items. The fields are ordered to keep the header small,
+ * as with many groups the headers may need more memory than the items. Small
+ * sets keep the items in the header itself (see SET_INLINE_BYTES).
+ */
 typedef struct element_set_t {
 
     uint32  item_size;  /* length of the value (depends on the actual data type) */
@@ -47,25 +182,369 @@ typedef struct element_set_t {
     uint32  nall;       /* number of all items (unsorted part may contain duplicates) */
     uint32  nbytes;     /* number of bytes in the data array */
 
-    /* used for arrays only (cache for get_typlenbyvalalign results) */
-    char    typalign;
+    /* degrade to a sketch once data would need more than this (0 - never) */
+    uint32  max_bytes;
+
+    /*
+     * Hash mode only. The all-zero value marks empty slots, so it's tracked
+     * separately. Inputs and new items since the last resize are counted
+     * to decide whether to switch to the sorted array.
+     */
+    uint32  hash_inputs;
+    uint32  hash_new;
+    bool    has_zero;
+
+    /* SET_MODE_ARRAY, SET_MODE_HASH, SET_MODE_SKETCH or SET_MODE_BITMAP */
+    uint8   mode;
+
+    /*
+     * Deserialized states point to the serialized data (encoded as described
+     * at set_header_t), and get copied only when it needs to be modified.
+     */
+    bool    readonly;
+    uint8   encoding;   /* SET_ENCODING_RAW or SET_ENCODING_DELTA */
+
+    /* the last compaction found few duplicates (so grow instead of compacting) */
+    bool    few_dups;
+
+    /*
+     * All the values so far arrived in increasing order, so the array is a
+     * single sorted part extended on append (see add_ordered).
+     */
+    bool    ordered;
+
+    /* bitmap mode only - key of the first bit (a multiple of 64) */
+    uint64  base;
+
+    /* type of the values (cache for the type lookups) */
+    value_type_t vtype;
 
     /* aggregation memory context (reference, so we don't need to do lookups repeatedly) */
     MemoryContext aggctx;
 
-    /* elements */
-    char *  data;       /* nsorted items first, then (nall - nsorted) unsorted items */
+    /* sorting kernel for the unsorted part (depends on item_size) */
+    sort_items_fn sort_items;
+
+    /*
+     * elements - in array mode nsorted items first, then (nall - nsorted)
+     * unsorted items, in hash mode (nbytes / item_size) hash slots, in
+     * sketch mode nbytes HyperLogLog registers, in bitmap mode the words
+     * with a bit for each key (nall = nsorted is the number of bits set)
+     */
+    char *  data;
+
+    /* sorted runs collected by combine, not merged into data yet */
+    struct set_run_t *runs;
+    Size    runs_bytes;
+
+    /* sorted runs written to a temporary file (see set_spill) */
+    struct set_spill_t *spill;
+
+    /* counters (NULL - not collected) */
+    struct set_stats_t *stats;
+
+    /* scratch space for sorting and merging the tail (kept between compactions) */
+    char   *scratch;
+
+    uint32  nruns;
+    uint32  maxruns;
+    uint32  scratch_bytes;
+
+    /* storage for small sets, so that they don't need another allocation */
+    uint64  inline_data[SET_INLINE_BYTES / sizeof(uint64)];
 
 } element_set_t;
 
+#define SET_DATA_INLINE(eset)   ((eset)->data == (char *) (eset)->inline_data)
+
+/*
+ * Bump allocator for the set headers, shared by all groups using the same
+ * aggregate context. The headers are never freed individually (they go away
+ * with the context), so there's no per-chunk overhead or rounding, and the
+ * headers of the groups end up next to each other. The blocks start small
+ * (sorted aggregation resets the context after each group) and double.
+ */
+#define ARENA_MIN_BLOCK     1024
+#define ARENA_MAX_BLOCK     (64 * 1024)
+#define ARENA_MAX_CONTEXTS  4       /* e.g. hashed grouping sets use one context per set */
+
+typedef struct set_arena_t {
+
+    MemoryContext   ctx;        /* blocks are allocated here (NULL - unused) */
+    char           *ptr;        /* free space in the current block */
+    Size            avail;
+    Size            block_size; /* size of the next block */
+
+} set_arena_t;
+
+/*
+ * Counters describing the work done on a set, collected only with either
+ * lrtm_count_distinct.track_stats or log_stats enabled (otherwise the set
+ * has no stats, and updating them is a single check). The same counters are
+ * summed for the whole backend, see lrtm_count_distinct_stats().
+ */
+typedef struct set_stats_t {
+
+    int64   sets;               /* number of sets (backend totals only) */
+    int64   compactions;        /* number of compactions */
+    int64   items_sorted;       /* items in the sorted tails */
+    int64   dups_removed;       /* duplicates removed by the compactions */
+    int64   grows;              /* growths of the array (or hash table) */
+    int64   combine_bytes;      /* bytes of other sets merged by combine */
+    int64   serialized_bytes;   /* bytes of the serialized states */
+    int64   spilled_bytes;      /* bytes written to temporary files */
+
+} set_stats_t;
+
+#define SET_STATS_ADD(eset, field, value) \
+    do { \
+        if ((eset)->stats != NULL) \
+        { \
+            (eset)->stats->field += (value); \
+            backend_stats.field += (value); \
+        } \
+    } while (0)
+
+/*
+ * Per-call cache kept in fn_extra - the resolved type of the values, so that
+ * the per-row path needs no lookups at all, and the arenas for set headers
+ * (one per aggregate context).
+ */
+typedef struct fn_cache_t {
+
+    Oid             element_type;   /* InvalidOid - not resolved yet */
+    bool            has_vtype;      /* vtype is valid */
+    value_type_t    vtype;
+
+    /* composite keys - types of the columns, and a buffer for the key */
+    int             ncolumns;
+    value_type_t   *columns;
+    char           *key;
+
+    set_arena_t     arenas[ARENA_MAX_CONTEXTS];
+
+} fn_cache_t;
+
+/* forgets the blocks of an arena when its memory context gets reset */
+typedef struct arena_reset_t {
+
+    MemoryContextCallback   callback;
+    set_arena_t            *arena;
+    MemoryContext           ctx;
+
+} arena_reset_t;
+
+/*
+ * Header of the serialized state - only fixed-size fields, no pointers. The
+ * layout is versioned, so that it can be changed later. Version 1 was this
+ * struct as laid out in memory. Since version 2 the header has a fixed layout
+ * (see set_header_write) and all the multi-byte fields, 2/4/8B items, bitmap
+ * base and words are little-endian, so states can be moved between machines
+ * (e.g. partial aggregates combined on a remote node, or stored sets). That
+ * matches version 1 on little-endian machines, where the items are still
+ * used in place. Version 1 states are still accepted, as native ones.
+ *
+ * Version 2 also records the base type of the values, so that sets of
+ * different types with the same item size (e.g. int4 and date) are not
+ * combined. User-defined types are recorded as InvalidOid (not checked),
+ * as their OIDs change with a dump and restore.
+ */
+#define SET_FORMAT_VERSION  2
+#define SET_HEADER_BYTES    20
+#define SET_HEADER_V1_BYTES 16
+
+#define SET_ENCODING_RAW    0   /* items (or registers) copied as they are */
+#define SET_ENCODING_DELTA  1   /* first item, then gaps (minus one), as varints */
+
+typedef struct set_header_t {
+
+    uint8   version;    /* SET_FORMAT_VERSION */
+    uint8   mode;       /* SET_MODE_ARRAY, SET_MODE_SKETCH or SET_MODE_BITMAP */
+    uint8   encoding;   /* SET_ENCODING_RAW or SET_ENCODING_DELTA */
+    uint8   kind;       /* value_type_t.kind */
+    uint16  item_size;
+    char    typalign;
+    uint8   order;      /* value_type_t.order */
+    uint32  nitems;     /* number of (distinct) items */
+    uint32  max_bytes;
+    Oid     typid;      /* value_type_t.typid (since version 2) */
+
+} set_header_t;
+
+/* sorted run of distinct items (raw or delta-encoded), owned by the set */
+typedef struct set_run_t {
+
+    char   *data;
+    Size    nbytes;
+    uint32  nitems;
+    uint8   encoding;
+
+} set_run_t;
+
+/*
+ * Runs spilled to a temporary file, once the set would need more memory than
+ * lrtm_count_distinct.spill_bytes. The runs are raw sorted items, and when
+ * there are SPILL_MERGE_FANIN runs of the same level, they get merged into
+ * a single run of the next level (so only a few runs need to be merged at
+ * the end, and each item gets rewritten only a few times).
+ */
+typedef struct set_spill_run_t {
+
+    int         fileno;     /* position in the file (see BufFileTell) */
+    off_t       offset;
+    uint32      nitems;
+    int         level;
+
+} set_spill_run_t;
+
+/*
+ * Closes the temporary file of a set when its memory context gets reset (the
+ * final function may only read the runs, without freeing the set). Allocated
+ * separately from the spill, so that spill_free only needs to clear the file.
+ *
+ * On abort the resource owner closes the files before the contexts get
+ * reset, so the open files are also kept in a list (open_spills), and an
+ * abort of the (sub)transaction that created them just forgets them.
+ */
+typedef struct spill_reset_t {
+
+    MemoryContextCallback   callback;
+    BufFile                *file;       /* NULL - already closed (not in the list) */
+    SubTransactionId        subid;      /* (sub)transaction owning the file */
+    struct spill_reset_t   *next;       /* next open file in open_spills */
+
+} spill_reset_t;
+
+typedef struct set_spill_t {
+
+    BufFile    *file;
+    spill_reset_t *reset;
+
+    /* end of the file, where the next run gets written */
+    int         end_fileno;
+    off_t       end_offset;
+
+    set_spill_run_t *runs;
+    int         nruns;
+    int         maxruns;
+
+    /* write buffer for merged runs */
+    char       *buffer;
+    Size        nbuffered;
+
+} set_spill_t;
+
+/*
+ * Sequential reader of a sorted run of distinct items - either a compacted
+ * set, or the read-only data of a deserialized one (possibly delta-encoded),
+ * or a run spilled to a file (read in chunks). The item pointer is valid only
+ * until the next call of reader_next.
+ */
+typedef struct run_reader_t {
+
+    const char *ptr;        /* next item (raw or encoded) */
+    const char *end;
+    uint32      remaining;  /* number of items not returned yet */
+    int         item_size;
+    uint8       encoding;
+
+    uint64      value;      /* last decoded value (delta encoding) */
+    char        buffer[sizeof(uint64)];
+
+    const char *item;       /* current item */
+
+    /* spilled run - position of the next chunk in the file */
+    BufFile    *file;
+    int         fileno;
+    off_t       offset;
+    char       *chunk;
+
+} run_reader_t;
+
+/* HyperLogLog sketch used by the approximate aggregate */
+typedef struct hll_state_t {
+
+    uint8   precision;  /* number of index bits (2^precision registers) */
+
+    /* type of the values (only needed when adding values) */
+    value_type_t vtype;
+
+    /* registers (max rank observed for each index) */
+    uint8   registers[FLEXIBLE_ARRAY_MEMBER];
+
+} hll_state_t;
+
+/*
+ * Counted multiset used by the moving-aggregate (window) variant and by
+ * lrtm_top_k - a linear probing table of items with their multiplicity, so
+ * that rows leaving the frame can be removed. A slot with zero count is
+ * empty, so there's no need to track the zero item separately (unlike in
+ * the hash mode).
+ */
+typedef struct counted_set_t {
+
+    value_type_t vtype;
+
+    int     item_size;
+    uint32  nslots;     /* number of slots (power of two) */
+    uint32  nitems;     /* number of distinct items (slots with count > 0) */
+
+    char   *items;      /* nslots items */
+    uint64 *counts;     /* multiplicity of the items, 0 means empty slot */
+
+    uint32  k;          /* values returned by lrtm_top_k (0 for the moving aggregate) */
+
+} counted_set_t;
+
+/*
+ * State of lrtm_count_distinct_grouped - (group, value) pairs of all the
+ * groups in a single array, instead of a set per group. The first ndistinct
+ * pairs were compacted (see grouped_compact), the rest is appended as it
+ * comes. Values are stored as 64-bit items (values of up to 8 bytes, and
+ * fingerprints for the larger ones).
+ */
+typedef struct grouped_pair_t {
+
+    uint64  group;
+    uint64  value;
+
+} grouped_pair_t;
+
+typedef struct grouped_state_t {
+
+    value_type_t vtype;
+
+    MemoryContext ctx;
+
+    Size    npairs;
+    Size    ndistinct;  /* pairs compacted by the last compaction */
+    Size    maxpairs;   /* allocated space (pairs) */
+
+    /* the last compaction found few duplicates (so grow instead of compacting) */
+    bool    few_dups;
+
+    grouped_pair_t *pairs;
+
+} grouped_state_t;
+
+#define HLL_NREGISTERS(precision)   (1U << (precision))
+#define HLL_STATE_SIZE(precision)   (offsetof(hll_state_t, registers) + HLL_NREGISTERS(precision))
+
+/* serialized state - the precision byte, followed by the registers */
+#define HLL_HEADER_BYTES            1
+
 
 /*
  * prototypes
  */
 
+void _PG_init(void);
+
 /* transition functions */
 PG_FUNCTION_INFO_V1(lrtm_count_distinct_append);
+PG_FUNCTION_INFO_V1(lrtm_count_distinct_multi_append);
 PG_FUNCTION_INFO_V1(lrtm_count_distinct_elements_append);
+PG_FUNCTION_INFO_V1(lrtm_count_distinct_hybrid_append);
 
 /* parallel aggregation support functions */
 PG_FUNCTION_INFO_V1(lrtm_count_distinct_serial);
@@ -74,20 +553,271 @@ PG_FUNCTION_INFO_V1(lrtm_count_distinct_combine);
 
 /* final functions */
 PG_FUNCTION_INFO_V1(lrtm_count_distinct);
+PG_FUNCTION_INFO_V1(lrtm_count_distinct_hybrid);
 PG_FUNCTION_INFO_V1(lrtm_array_agg_distinct_type_by_element);
 PG_FUNCTION_INFO_V1(lrtm_array_agg_distinct_type_by_array);
 
+/* persistable sets (lrtm_distinct_set) */
+PG_FUNCTION_INFO_V1(lrtm_distinct_set_in);
+PG_FUNCTION_INFO_V1(lrtm_distinct_set_out);
+PG_FUNCTION_INFO_V1(lrtm_distinct_set_recv);
+PG_FUNCTION_INFO_V1(lrtm_distinct_set_send);
+PG_FUNCTION_INFO_V1(lrtm_distinct_set_cardinality);
+PG_FUNCTION_INFO_V1(lrtm_distinct_union_append);
+PG_FUNCTION_INFO_V1(lrtm_distinct_set_intersect_count);
+PG_FUNCTION_INFO_V1(lrtm_distinct_set_difference_count);
+PG_FUNCTION_INFO_V1(lrtm_distinct_set_union_count);
+
+/* moving-aggregate (window) variant of lrtm_count_distinct */
+PG_FUNCTION_INFO_V1(lrtm_count_distinct_moving_append);
+PG_FUNCTION_INFO_V1(lrtm_count_distinct_moving_remove);
+PG_FUNCTION_INFO_V1(lrtm_count_distinct_moving);
+
+/* most frequent values (counted like in the moving aggregate) */
+PG_FUNCTION_INFO_V1(lrtm_top_k_append);
+PG_FUNCTION_INFO_V1(lrtm_top_k_serial);
+PG_FUNCTION_INFO_V1(lrtm_top_k_deserial);
+PG_FUNCTION_INFO_V1(lrtm_top_k_combine);
+PG_FUNCTION_INFO_V1(lrtm_top_k);
+PG_FUNCTION_INFO_V1(lrtm_top_k_counts);
+
+/* distinct counts of all groups at once */
+PG_FUNCTION_INFO_V1(lrtm_count_distinct_grouped_append);
+PG_FUNCTION_INFO_V1(lrtm_count_distinct_grouped_serial);
+PG_FUNCTION_INFO_V1(lrtm_count_distinct_grouped_deserial);
+PG_FUNCTION_INFO_V1(lrtm_count_distinct_grouped_combine);
+PG_FUNCTION_INFO_V1(lrtm_count_distinct_grouped);
+
+/* diagnostics */
+PG_FUNCTION_INFO_V1(lrtm_count_distinct_stats);
+PG_FUNCTION_INFO_V1(lrtm_count_distinct_stats_reset);
+
+/* approximate (HyperLogLog) aggregate */
+PG_FUNCTION_INFO_V1(lrtm_count_distinct_approx_append);
+PG_FUNCTION_INFO_V1(lrtm_count_distinct_approx_serial);
+PG_FUNCTION_INFO_V1(lrtm_count_distinct_approx_deserial);
+PG_FUNCTION_INFO_V1(lrtm_count_distinct_approx_combine);
+PG_FUNCTION_INFO_V1(lrtm_count_distinct_approx);
+
 /* supplementary subroutines */
 static void add_element(element_set_t * eset, char * value);
-static element_set_t *init_set(int item_size, char typalign, MemoryContext ctx);
+static void add_elements(element_set_t * eset, char * items, int nitems);
+static inline bool add_ordered(element_set_t * eset, char * value);
+static int array_count_nonnull(bits8 * null_bitmap, int nitems);
+static void hash_add_element(element_set_t * eset, char * value);
+static void hash_grow(element_set_t * eset);
+static void hash_to_array(element_set_t * eset);
+static void array_to_hash(element_set_t * eset);
+static void set_end_ordered(element_set_t * eset);
+static bool set_to_bitmap(element_set_t * eset);
+static void bitmap_to_array(element_set_t * eset);
+static inline bool bitmap_add(element_set_t * eset, const char * value);
+static bool bitmap_extend(element_set_t * eset, uint64 key);
+static bool bitmap_add_set(element_set_t * eset, element_set_t * src);
+static void bitmap_items(element_set_t * eset, char * out);
+static void set_replace_data(element_set_t * eset, char * data, Size nbytes);
+static element_set_t *init_set(value_type_t * vtype, MemoryContext ctx, Size init_bytes,
+                               set_arena_t * arena);
+static fn_cache_t *get_fn_cache(FunctionCallInfo fcinfo);
+static Oid get_element_type_cached(FunctionCallInfo fcinfo, bool is_array);
+static value_type_t *get_value_type_cached(FunctionCallInfo fcinfo, bool is_array);
+static value_type_t *get_hash_type_cached(FunctionCallInfo fcinfo);
+static value_type_t *get_key_type_cached(FunctionCallInfo fcinfo);
+static set_arena_t *get_set_arena(FunctionCallInfo fcinfo, MemoryContext ctx);
+static void *set_arena_alloc(set_arena_t * arena, Size size);
+static void set_arena_reset(void * arg);
+static void set_resize_data(element_set_t * eset, Size nbytes);
+static void set_free_data(element_set_t * eset);
+static Size initial_set_bytes(FunctionCallInfo fcinfo, value_type_t * vtype);
+static inline int value_item_size(value_type_t * vtype);
+static bool grow_set(element_set_t * eset);
+static void lookup_value_type(Oid element_type, Oid collation, value_type_t * vtype);
+static bool try_lookup_value_type(Oid element_type, Oid collation, value_type_t * vtype);
+static uint64 hash_value(value_type_t * vtype, Datum value);
+static char *value_to_item(value_type_t * vtype, Datum * value, uint64 * fingerprint);
 static int compare_items(const void * a, const void * b, void * size);
+static inline int compare_values(const char * a, const char * b, int size);
+static sort_items_fn choose_sort_kernel(int item_size);
+static int dedup_items(element_set_t * eset, char * data, int nitems);
+static int dedup_items_generic(char * data, int nitems, int item_size);
+static int dedup_items_1(char * data, int nitems);
+static int dedup_items_2(char * data, int nitems);
+static int dedup_items_4(char * data, int nitems);
+static int dedup_items_8(char * data, int nitems);
+static void choose_dedup_kernels(void);
 static void compact_set(element_set_t * eset, bool need_space);
-static Datum build_array(element_set_t * eset, Oid input_type);
-
-#if DEBUG_PROFILE
-static void print_set_stats(element_set_t * eset);
+static Datum build_array(element_set_t * eset, Oid element_type);
+static inline uint64 hash_key(uint64 key);
+static uint64 hash_bytes64(const char * data, int len);
+static uint64 hash_datum(Datum value, int16 typlen, bool typbyval);
+static inline uint64 hash_item(const char * item, int item_size);
+static hll_state_t *hll_init(int precision);
+static inline void hll_add_hash(uint8 * registers, int precision, uint64 hash);
+static double hll_estimate(const uint8 * registers, int precision);
+static void set_to_sketch(element_set_t * eset);
+static inline uint64 load_item(const char * item, int item_size);
+static inline void store_item(char * item, int item_size, uint64 value);
+static inline uint64 value_to_key(uint8 order, int width, uint64 value);
+static inline uint64 key_to_value(uint8 order, int width, uint64 key);
+static void keys_from_values(uint8 order, int width, char * items, Size nitems);
+static Size delta_encoded_size(const char * data, uint32 nitems, int item_size);
+static char *delta_encode(const char * data, uint32 nitems, int item_size, char * out);
+static void delta_decode(const char * in, Size len, uint32 nitems, int item_size, char * out);
+static void set_materialize(element_set_t * eset);
+static inline uint64 load_le(const char * ptr, int nbytes);
+static inline void store_le(char * ptr, int nbytes, uint64 value);
+static void set_header_write(const set_header_t * header, char * out);
+static int set_header_read(const char * in, set_header_t * header);
+#ifdef WORDS_BIGENDIAN
+static void swap_items(char * items, Size nitems, int item_size);
+static char *set_portable_items(element_set_t * eset);
+static void set_native_items(element_set_t * eset, uint8 encoding);
+#endif
+static element_set_t *set_from_bytes(char * ptr, Size len, MemoryContext aggcontext);
+static void set_check_items(element_set_t * eset);
+static element_set_t *combine_sets(FunctionCallInfo fcinfo, MemoryContext agg_context,
+                                   element_set_t * eset1, element_set_t * eset2);
+static void check_same_type(element_set_t * eset1, element_set_t * eset2);
+static int64 intersect_count(element_set_t * eset1, element_set_t * eset2);
+static int64 intersect_count_linear(element_set_t * eset1, element_set_t * eset2);
+static int64 intersect_count_gallop(element_set_t * small, element_set_t * large);
+static int64 intersect_count_bitmap(element_set_t * bitmap, element_set_t * other);
+static double sketch_union_estimate(element_set_t * eset1, element_set_t * eset2);
+static counted_set_t *counted_init(value_type_t * vtype);
+static uint32 counted_find(counted_set_t * cset, char * item);
+static void counted_add(counted_set_t * cset, char * item, uint64 count);
+static void counted_remove(counted_set_t * cset, char * item);
+static void counted_grow(counted_set_t * cset);
+static uint32 counted_top(counted_set_t * cset, uint32 * slots);
+static void counted_sift_down(counted_set_t * cset, uint32 * heap, uint32 n, uint32 j);
+static grouped_state_t *grouped_init(value_type_t * vtype, MemoryContext ctx, Size maxpairs);
+static void grouped_reserve(grouped_state_t * gstate, Size nnew);
+static void grouped_compact(grouped_state_t * gstate);
+static void sort_pairs(grouped_pair_t * pairs, Size npairs, grouped_pair_t * scratch);
+static void reader_init(run_reader_t * reader, element_set_t * eset);
+static void reader_init_run(run_reader_t * reader, const char * data, Size nbytes,
+                            uint32 nitems, int item_size, uint8 encoding);
+static void set_add_run(element_set_t * eset, element_set_t * src);
+static Size kway_merge(run_reader_t * readers, int nruns, int item_size, char * output,
+                       set_spill_t * spill);
+static Size spill_limit(void);
+static Size set_memory_limit(element_set_t * eset);
+static void set_spill(element_set_t * eset);
+static void set_unspill(element_set_t * eset);
+static void spill_free(element_set_t * eset);
+static set_spill_t *spill_create(element_set_t * eset);
+static void spill_reset(void * arg);
+static void spill_forget(spill_reset_t * reset);
+static void spill_xact_callback(XactEvent event, void * arg);
+static void spill_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+                                   SubTransactionId parentSubid, void * arg);
+static void spill_add_run(element_set_t * eset, int fileno, off_t offset, uint32 nitems, int level);
+static void spill_absorb(element_set_t * eset, element_set_t * src);
+static void spill_write(set_spill_t * spill, const char * data, Size nbytes);
+static void spill_append(set_spill_t * spill, const char * item, int item_size);
+static void spill_merge_level(element_set_t * eset, int first);
+static void spill_insert_run(set_spill_t * spill, int fileno, off_t offset, uint32 nitems,
+                             int level);
+static int  spill_init_readers(element_set_t * eset, run_reader_t * readers, int first);
+static void reader_init_file(run_reader_t * reader, set_spill_t * spill,
+                             set_spill_run_t * run, int item_size);
+static void reader_fill(run_reader_t * reader);
+static void merge_runs(element_set_t * eset);
+static void sort_tail(element_set_t * eset);
+static void merge_tail(element_set_t * eset);
+static char *set_scratch(element_set_t * eset, Size nbytes);
+static int64 count_distinct(element_set_t * eset);
+static inline bool reader_next(run_reader_t * reader);
+static int64 set_count(element_set_t * eset);
+static void log_set_stats(element_set_t * eset);
+static void track_context_peak(FunctionCallInfo fcinfo);
+
+/* GUC variables */
+static int  max_exact_bytes = DEFAULT_MAX_EXACT_BYTES;
+static int  initial_bytes = INITIAL_BYTES_AUTO;
+static int  spill_bytes = SPILL_BYTES_WORK_MEM;
+static bool track_stats = false;
+static bool log_stats = false;
+
+/* temporary files of the sets, not closed yet (see spill_reset_t) */
+static spill_reset_t *open_spills = NULL;
+
+/* counters summed over all sets of the backend */
+static set_stats_t backend_stats;
+
+/* largest aggregate context seen by a final function (see track_context_peak) */
+static Size backend_peak_bytes = 0;
+
+/* dedup kernels for 4/8B items (SIMD if available, see choose_dedup_kernels) */
+static dedup_items_fn dedup_kernel_4 = dedup_items_4;
+static dedup_items_fn dedup_kernel_8 = dedup_items_8;
+
+void
+_PG_init(void)
+{
+    DefineCustomIntVariable("lrtm_count_distinct.max_exact_bytes",
+                            "Memory limit for exact sets in lrtm_count_distinct_hybrid.",
+                            "Sets that would need more memory degrade to a HyperLogLog "
+                            "sketch (16kB). Zero means the sets never degrade.",
+                            &max_exact_bytes,
+                            DEFAULT_MAX_EXACT_BYTES,
+                            0, INT_MAX,
+                            PGC_USERSET,
+                            GUC_UNIT_BYTE,
+                            NULL, NULL, NULL);
+
+    DefineCustomIntVariable("lrtm_count_distinct.initial_bytes",
+                            "Initial size of the per-group sets.",
+                            "-1 means the size is derived from the planner estimates "
+                            "of the number of rows per group.",
+                            &initial_bytes,
+                            INITIAL_BYTES_AUTO,
+                            -1, INT_MAX,
+                            PGC_USERSET,
+                            GUC_UNIT_BYTE,
+                            NULL, NULL, NULL);
+
+    DefineCustomIntVariable("lrtm_count_distinct.spill_bytes",
+                            "Memory limit for exact sets, before they spill to temporary files.",
+                            "Larger sets write sorted runs to a temporary file, merged when "
+                            "computing the result. -1 means work_mem, zero means the sets "
+                            "never spill.",
+                            &spill_bytes,
+                            SPILL_BYTES_WORK_MEM,
+                            -1, INT_MAX,
+                            PGC_USERSET,
+                            GUC_UNIT_BYTE,
+                            NULL, NULL, NULL);
+
+    DefineCustomBoolVariable("lrtm_count_distinct.track_stats",
+                             "Collects statistics about compactions of the sets.",
+                             "See lrtm_count_distinct_stats().",
+                             &track_stats,
+                             false,
+                             PGC_USERSET,
+                             0,
+                             NULL, NULL, NULL);
+
+    DefineCustomBoolVariable("lrtm_count_distinct.log_stats",
+                             "Logs statistics of each set when computing the result.",
+                             "Implies lrtm_count_distinct.track_stats.",
+                             &log_stats,
+                             false,
+                             PGC_USERSET,
+                             0,
+                             NULL, NULL, NULL);
+
+#if PG_VERSION_NUM >= 150000
+    MarkGUCPrefixReserved("lrtm_count_distinct");
+#else
+    EmitWarningsOnPlaceholders("lrtm_count_distinct");
 #endif
 
+    choose_dedup_kernels();
+
+    RegisterXactCallback(spill_xact_callback, NULL);
+    RegisterSubXactCallback(spill_subxact_callback, NULL);
+}
 
 Datum
 lrtm_count_distinct_append(PG_FUNCTION_ARGS)
@@ -95,8 +825,9 @@ lrtm_count_distinct_append(PG_FUNCTION_ARGS)
     element_set_t  *eset;
 
     /* info for anyelement */
-    Oid         element_type = get_fn_expr_argtype(fcinfo->flinfo, 1);
     Datum       element = PG_GETARG_DATUM(1);
+    uint64      fingerprint;
+    char       *item;
 
     /* memory contexts */
     MemoryContext oldcontext;
@@ -116,28 +847,92 @@ lrtm_count_distinct_append(PG_FUNCTION_ARGS)
     /* switch to the per-group hash-table memory context */
     GET_AGG_CONTEXT("lrtm_count_distinct_append", fcinfo, aggcontext);
 
-    oldcontext = MemoryContextSwitchTo(aggcontext);
-
     /* init the hash table, if needed */
     if (PG_ARGISNULL(0))
     {
-        int16       typlen;
-        bool        typbyval;
-        char        typalign;
+        /* type information for the second parameter (anyelement item) */
+        value_type_t   *vtype = get_value_type_cached(fcinfo, false);
+
+        oldcontext = MemoryContextSwitchTo(aggcontext);
+        eset = init_set(vtype, aggcontext, initial_set_bytes(fcinfo, vtype),
+                        get_set_arena(fcinfo, aggcontext));
+        MemoryContextSwitchTo(oldcontext);
+    } else
+        eset = (element_set_t *)PG_GETARG_POINTER(0);
+
+    /* hashing may allocate memory, so do that in the per-tuple context */
+    item = value_to_item(&eset->vtype, &element, &fingerprint);
+
+    /* add the value into the set */
+    oldcontext = MemoryContextSwitchTo(aggcontext);
+
+    add_element(eset, item);
+
+    MemoryContextSwitchTo(oldcontext);
+
+    PG_RETURN_POINTER(eset);
+}
+
+/*
+ * Adds a composite key of all the arguments (see get_key_type_cached). The
+ * columns are turned into items just like single values, and packed into
+ * a single item, so the set does not care about the columns at all. Rows
+ * with a NULL in any of the columns are ignored.
+ */
+Datum
+lrtm_count_distinct_multi_append(PG_FUNCTION_ARGS)
+{
+    element_set_t  *eset;
+    value_type_t   *vtype;
+    fn_cache_t     *cache;
+    char           *key;
+    int             i;
+
+    /* memory contexts */
+    MemoryContext oldcontext;
+    MemoryContext aggcontext;
+
+    for (i = 1; i < PG_NARGS(); i++)
+    {
+        if (PG_ARGISNULL(i))
+        {
+            if (PG_ARGISNULL(0))
+                PG_RETURN_NULL();
+
+            PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+        }
+    }
 
-        /* get type information for the second parameter (anyelement item) */
-        get_typlenbyvalalign(element_type, &typlen, &typbyval, &typalign);
+    GET_AGG_CONTEXT("lrtm_count_distinct_multi_append", fcinfo, aggcontext);
 
-        /* we can't handle varlena types yet or values passed by reference */
-        if ((typlen < 0) || (! typbyval))
-            elog(ERROR, "lrtm_count_distinct handles only fixed-length types passed by value");
+    vtype = get_key_type_cached(fcinfo);
+    cache = get_fn_cache(fcinfo);
 
-        eset = init_set(typlen, typalign, aggcontext);
+    if (PG_ARGISNULL(0))
+    {
+        oldcontext = MemoryContextSwitchTo(aggcontext);
+        eset = init_set(vtype, aggcontext, initial_set_bytes(fcinfo, vtype),
+                        get_set_arena(fcinfo, aggcontext));
+        MemoryContextSwitchTo(oldcontext);
     } else
         eset = (element_set_t *)PG_GETARG_POINTER(0);
 
-    /* add the value into the set */
-    add_element(eset, (char*)&element);
+    /* hashing may allocate memory, so do that in the per-tuple context */
+    key = cache->key;
+    for (i = 0; i < cache->ncolumns; i++)
+    {
+        value_type_t   *column = &cache->columns[i];
+        Datum           value = PG_GETARG_DATUM(i + 1);
+        uint64          fingerprint;
+        int             width = value_item_size(column);
+
+        memcpy(key, value_to_item(column, &value, &fingerprint), width);
+        key += width;
+    }
+
+    oldcontext = MemoryContextSwitchTo(aggcontext);
+
+    add_element(eset, cache->key);
 
     MemoryContextSwitchTo(oldcontext);
 
@@ -150,10 +945,6 @@ lrtm_count_distinct_elements_append(PG_FUNCTION_ARGS)
     int             i;
     element_set_t  *eset = NULL;
 
-    /* info for anyarray */
-    Oid input_type;
-    Oid element_type;
-
     /* array data */
     ArrayType  *input;
     int         ndims;
@@ -162,6 +953,9 @@ lrtm_count_distinct_elements_append(PG_FUNCTION_ARGS)
     bits8      *null_bitmap;
     char       *arr_ptr;
     Datum       element;
+    uint64      fingerprint;
+    char       *item;
+    value_type_t    vtype;
 
     /* memory contexts */
     MemoryContext oldcontext;
@@ -174,10 +968,6 @@ lrtm_count_distinct_elements_append(PG_FUNCTION_ARGS)
 
     /* from now on we know the new value is not NULL */
 
-    /* get the type of array elements */
-    input_type = get_fn_expr_argtype(fcinfo->flinfo, 1);
-    element_type = get_element_type(input_type);
-
     /*
      * parse the array contents (we know we got non-NULL value)
      */
@@ -191,7 +981,43 @@ lrtm_count_distinct_elements_append(PG_FUNCTION_ARGS)
     /* make sure we're running as part of aggregate function */
     GET_AGG_CONTEXT("lrtm_count_distinct_elements_append", fcinfo, aggcontext);
 
-    oldcontext = MemoryContextSwitchTo(aggcontext);
+    /*
+     * NULL elements take no space in the array data, so for fixed-length
+     * types stored without padding and compared by the bytes, the non-NULL
+     * elements are contiguous items we can add in a single batch.
+     */
+    if (PG_ARGISNULL(0))
+        vtype = *get_value_type_cached(fcinfo, true);
+    else
+        vtype = ((element_set_t *) PG_GETARG_POINTER(0))->vtype;
+
+    if ((vtype.kind != VALUE_FINGERPRINT) &&
+        (att_align_nominal(vtype.typlen, vtype.typalign) == vtype.typlen))
+    {
+        int     nvalues = null_bitmap ? array_count_nonnull(null_bitmap, nitems) : nitems;
+
+        if (nvalues == 0)
+        {
+            if (PG_ARGISNULL(0))
+                PG_RETURN_NULL();
+
+            PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+        }
+
+        oldcontext = MemoryContextSwitchTo(aggcontext);
+
+        if (PG_ARGISNULL(0))
+            eset = init_set(&vtype, aggcontext, initial_set_bytes(fcinfo, &vtype),
+                            get_set_arena(fcinfo, aggcontext));
+        else
+            eset = (element_set_t *) PG_GETARG_POINTER(0);
+
+        add_elements(eset, arr_ptr, nvalues);
+
+        MemoryContextSwitchTo(oldcontext);
+
+        PG_RETURN_POINTER(eset);
+    }
 
     /* add all array elements to the set */
     for (i = 0; i < nitems; i++)
@@ -205,113 +1031,197 @@ lrtm_count_distinct_elements_append(PG_FUNCTION_ARGS)
         {
             if (PG_ARGISNULL(0))
             {
-                int16       typlen;
-                bool        typbyval;
-                char        typalign;
-
-                /* get type information for the second parameter (anyelement item) */
-                get_typlenbyvalalign(element_type, &typlen, &typbyval, &typalign);
-
-                /* we can't handle varlena types yet or values passed by reference */
-                if ((typlen < 0) || (! typbyval))
-                    elog(ERROR, "lrtm_count_distinct_elements handles only arrays of fixed-length types passed by value");
-
-                eset = init_set(typlen, typalign, aggcontext);
+                oldcontext = MemoryContextSwitchTo(aggcontext);
+                eset = init_set(&vtype, aggcontext, initial_set_bytes(fcinfo, &vtype),
+                        get_set_arena(fcinfo, aggcontext));
+                MemoryContextSwitchTo(oldcontext);
             }
             else
                 eset = (element_set_t *)PG_GETARG_POINTER(0);
         }
 
-        element = fetch_att(arr_ptr, true, eset->item_size);
+        element = fetch_att(arr_ptr, eset->vtype.typbyval, eset->vtype.typlen);
 
-        add_element(eset, (char*)&element);
+        /* hashing may allocate memory, so do that in the per-tuple context */
+        item = value_to_item(&eset->vtype, &element, &fingerprint);
+
+        oldcontext = MemoryContextSwitchTo(aggcontext);
+
+        add_element(eset, item);
+
+        MemoryContextSwitchTo(oldcontext);
 
         /* advance array pointer */
-        arr_ptr = att_addlength_pointer(arr_ptr, eset->item_size, arr_ptr);
-        arr_ptr = (char *) att_align_nominal(arr_ptr, eset->typalign);
+        arr_ptr = att_addlength_pointer(arr_ptr, eset->vtype.typlen, arr_ptr);
+        arr_ptr = (char *) att_align_nominal(arr_ptr, eset->vtype.typalign);
     }
 
-    MemoryContextSwitchTo(oldcontext);
-
     if (eset == NULL)
         PG_RETURN_NULL();
     else
         PG_RETURN_POINTER(eset);
 }
 
+/*
+ * Same as lrtm_count_distinct_append, but the new sets get the memory limit
+ * from lrtm_count_distinct.max_exact_bytes (so they may degrade to a sketch).
+ */
+Datum
+lrtm_count_distinct_hybrid_append(PG_FUNCTION_ARGS)
+{
+    bool    first = PG_ARGISNULL(0);
+    Datum   result = lrtm_count_distinct_append(fcinfo);
+
+    if (first && !fcinfo->isnull)
+        ((element_set_t *) DatumGetPointer(result))->max_bytes = max_exact_bytes;
+
+    PG_RETURN_DATUM(result);
+}
+
+/*
+ * The serialized state is a set_header_t followed by the items (or sketch
+ * registers). The sorted items of 1/2/4/8B are usually delta-encoded, which
+ * for clustered keys needs about a byte per item. Bitmaps are written as the
+ * base key and the words, unless the delta encoding would be smaller. All of
+ * it is in the portable (little-endian) layout, see SET_FORMAT_VERSION.
+ */
 Datum
 lrtm_count_distinct_serial(PG_FUNCTION_ARGS)
 {
     element_set_t * eset = (element_set_t *)PG_GETARG_POINTER(0);
-    Size    hlen = offsetof(element_set_t, data);   /* header */
+    set_header_t    header;
     Size    dlen;                                   /* elements */
     bytea  *out;                                    /* output */
     char   *ptr;
+    char   *items;
 
     Assert(eset != NULL);
 
     CHECK_AGG_CONTEXT("lrtm_count_distinct_serial", fcinfo);
 
-    compact_set(eset, false);
+    /* the serialized state has to include the spilled items */
+    if (eset->spill != NULL)
+        set_unspill(eset);
 
-    Assert(eset->nall > 0);
-    Assert(eset->nall == eset->nsorted);
+    compact_set(eset, false);
 
-    dlen = eset->nall * eset->item_size;
+    /* the delta encoding needs at least a byte per item */
+    if ((eset->mode == SET_MODE_BITMAP) && (eset->nbytes > eset->nall))
+        bitmap_to_array(eset);
 
-    out = (bytea *)palloc(VARHDRSZ + dlen + hlen);
+#ifdef WORDS_BIGENDIAN
+    /* keys of by-reference items depend on the byte order */
+    if ((eset->mode == SET_MODE_BITMAP) && (eset->vtype.kind == VALUE_BYREF))
+        bitmap_to_array(eset);
+#endif
 
-    SET_VARSIZE(out, VARHDRSZ + dlen + hlen);
-    ptr = VARDATA(out);
+    items = eset->data;
 
-    memcpy(ptr, eset, hlen);
-    ptr += hlen;
+    memset(&header, 0, sizeof(set_header_t));
+    header.version = SET_FORMAT_VERSION;
+    header.mode = eset->mode;
+    header.kind = eset->vtype.kind;
+    header.typalign = eset->vtype.typalign;
+    header.order = eset->vtype.order;
+    header.item_size = eset->item_size;
+    header.max_bytes = eset->max_bytes;
 
-    memcpy(ptr, eset->data, dlen);
+    /* OIDs of user-defined types are not stable (see set_header_t) */
+    if (eset->vtype.typid < FirstNormalObjectId)
+        header.typid = eset->vtype.typid;
 
-    PG_RETURN_BYTEA_P(out);
-}
+    /* sketch registers, bitmap, or the distinct items */
+    if (eset->mode == SET_MODE_SKETCH)
+    {
+        header.encoding = SET_ENCODING_RAW;
+        dlen = eset->nbytes;
+    }
+    else if (eset->mode == SET_MODE_BITMAP)
+    {
+        header.encoding = SET_ENCODING_RAW;
+        header.nitems = eset->nall;
+        dlen = sizeof(uint64) + eset->nbytes;
+    }
+    else
+    {
+        Size    delta_len;
 
-Datum
-lrtm_count_distinct_deserial(PG_FUNCTION_ARGS)
-{
-    element_set_t *eset = (element_set_t *)palloc(sizeof(element_set_t));
-    bytea  *state = (bytea *)PG_GETARG_POINTER(0);
-#ifdef USE_ASSERT_CHECKING
-    Size	len = VARSIZE_ANY_EXHDR(state);
-#endif
-    char   *ptr = VARDATA_ANY(state);
+        Assert(eset->nall > 0);
+        Assert(eset->nall == eset->nsorted);
 
-    CHECK_AGG_CONTEXT("lrtm_count_distinct_deserial", fcinfo);
+        header.nitems = eset->nall;
 
-    Assert(len > 0);
-    Assert((len - offsetof(element_set_t, data)) > 0);
+#ifdef WORDS_BIGENDIAN
+        items = set_portable_items(eset);
+#endif
 
-    /* copy the header */
-    memcpy(eset, ptr, offsetof(element_set_t, data));
-    ptr += offsetof(element_set_t, data);
+        dlen = eset->nall * eset->item_size;
+        delta_len = delta_encoded_size(items, eset->nall, eset->item_size);
 
-    Assert((eset->nall > 0) && (eset->nall == eset->nsorted));
-    Assert(len == offsetof(element_set_t, data) + eset->nall * eset->item_size);
+        header.encoding = (delta_len < dlen) ? SET_ENCODING_DELTA : SET_ENCODING_RAW;
+        dlen = Min(dlen, delta_len);
+    }
 
-    /* we only allocate the necessary space */
-    eset->data = palloc(eset->nall * eset->item_size);
-    eset->nbytes = eset->nall * eset->item_size;
+    out = (bytea *)palloc(VARHDRSZ + SET_HEADER_BYTES + dlen);
 
-    memcpy((void *)eset->data, ptr, eset->nall * eset->item_size);
+    SET_VARSIZE(out, VARHDRSZ + SET_HEADER_BYTES + dlen);
+    ptr = VARDATA(out);
 
-    PG_RETURN_POINTER(eset);
-}
+    set_header_write(&header, ptr);
+    ptr += SET_HEADER_BYTES;
 
-Datum
+    if (eset->mode == SET_MODE_BITMAP)
+    {
+        store_le(ptr, sizeof(uint64), eset->base);
+        memcpy(ptr + sizeof(uint64), eset->data, eset->nbytes);
+#ifdef WORDS_BIGENDIAN
+        swap_items(ptr + sizeof(uint64), eset->nbytes / sizeof(uint64), sizeof(uint64));
+#endif
+    }
+    else if (header.encoding == SET_ENCODING_DELTA)
+        delta_encode(items, eset->nall, eset->item_size, ptr);
+    else
+    {
+        memcpy(ptr, items, dlen);
+#ifdef WORDS_BIGENDIAN
+        if (eset->mode == SET_MODE_ARRAY)
+            swap_items(ptr, eset->nall, eset->item_size);
+#endif
+    }
+
+    if (items != eset->data)
+        pfree(items);
+
+    SET_STATS_ADD(eset, serialized_bytes, VARSIZE(out));
+    log_set_stats(eset);
+
+    PG_RETURN_BYTEA_P(out);
+}
+
+/*
+ * The deserialized state does not copy the items, it points directly to the
+ * (detoasted) bytea as a read-only sorted run, possibly delta-encoded. It's
+ * only copied if it needs to be modified (see set_materialize). Bitmaps are
+ * copied right away, combine modifies them in place.
+ */
+Datum
+lrtm_count_distinct_deserial(PG_FUNCTION_ARGS)
+{
+    bytea  *state = PG_GETARG_BYTEA_PP(0);
+    MemoryContext aggcontext;
+
+    GET_AGG_CONTEXT("lrtm_count_distinct_deserial", fcinfo, aggcontext);
+
+    PG_RETURN_POINTER(set_from_bytes(VARDATA_ANY(state), VARSIZE_ANY_EXHDR(state),
+                                     aggcontext));
+}
+
+Datum
 lrtm_count_distinct_combine(PG_FUNCTION_ARGS)
 {
-    int i;
-    char *data, *tmp, *ptr1, *ptr2, *prev;
     element_set_t *eset1;
     element_set_t *eset2;
     MemoryContext agg_context;
-    MemoryContext old_context;
 
     GET_AGG_CONTEXT("lrtm_count_distinct_combine", fcinfo, agg_context);
 
@@ -321,139 +1231,67 @@ lrtm_count_distinct_combine(PG_FUNCTION_ARGS)
     if (eset2 == NULL)
         PG_RETURN_POINTER(eset1);
 
-    if (eset1 == NULL)
-    {
-        old_context = MemoryContextSwitchTo(agg_context);
-
-        eset1 = (element_set_t *)palloc(sizeof(element_set_t));
-        eset1->item_size = eset2->item_size;
-        eset1->nsorted = eset2->nsorted;
-        eset1->nall = eset2->nall;
-        eset1->nbytes = eset2->nbytes;
-
-        eset1->data = palloc(eset1->nbytes);
-
-        memcpy(eset1->data, eset2->data, eset1->nbytes);
-
-        MemoryContextSwitchTo(old_context);
-
-        PG_RETURN_POINTER(eset1);
-    }
-
-    Assert((eset1 != NULL) && (eset2 != NULL));
-    Assert((eset1->item_size > 0) && (eset1->item_size == eset2->item_size));
-
-    /* make sure both states are sorted */
-    compact_set(eset1, false);
-    compact_set(eset2, false);
-
-    data = MemoryContextAlloc(agg_context, (eset1->nbytes + eset2->nbytes));
-    tmp = data;
-
-    /* merge the two arrays */
-    ptr1 = eset1->data;
-    ptr2 = eset2->data;
-    prev = NULL;
-
-    for (i = 0; i < eset1->nall + eset2->nall; i++)
-    {
-        char *element;
-
-        Assert(ptr1 <= (eset1->data + eset1->nbytes));
-        Assert(ptr2 <= (eset2->data + eset2->nbytes));
-
-        if ((ptr1 < (eset1->data + eset1->nbytes)) &&
-            (ptr2 < (eset2->data + eset2->nbytes)))
-        {
-            if (memcmp(ptr1, ptr2, eset1->item_size) <= 0)
-            {
-                element = ptr1;
-                ptr1 += eset1->item_size;
-            }
-            else
-            {
-                element = ptr2;
-                ptr2 += eset1->item_size;
-            }
-        }
-        else if (ptr1 < (eset1->data + eset1->nbytes))
-        {
-            element = ptr1;
-            ptr1 += eset1->item_size;
-        }
-        else if (ptr2 < (eset2->data + eset2->nbytes))
-        {
-            element = ptr2;
-            ptr2 += eset2->item_size;
-        }
-        else
-            elog(ERROR, "unexpected");
-		if (tmp == data)
-        {
-            /* first value, so just copy */
-            memcpy(tmp, element, eset1->item_size);
-            prev = tmp;
-            tmp += eset1->item_size;
-        }
-        else if (memcmp(prev, element, eset1->item_size) != 0)
-        {
-            /* not equal to the last one, so should be greater */
-            Assert(memcmp(prev, element, eset1->item_size) < 0);
+    PG_RETURN_POINTER(combine_sets(fcinfo, agg_context, eset1, eset2));
+}
 
-            /* first value, so just copy */
-            memcpy(tmp, element, eset1->item_size);
-            prev = tmp;
-            tmp += eset1->item_size;
-        }
-    }
+Datum
+lrtm_count_distinct(PG_FUNCTION_ARGS)
+{
+    element_set_t * eset;
 
-    /* we must have processed the input arrays completely */
-    Assert(ptr1 == (eset1->data + (eset1->nall * eset1->item_size)));
-    Assert(ptr2 == (eset2->data + (eset2->nall * eset2->item_size)));
+    CHECK_AGG_CONTEXT("lrtm_count_distinct", fcinfo);
+    track_context_peak(fcinfo);
 
-    /* we might have eliminated some duplicate elements */
-    Assert((tmp - data) <= ((eset1->nall + eset2->nall) * eset1->item_size));
+    if (PG_ARGISNULL(0))
+        PG_RETURN_NULL();
 
-    pfree(eset1->data);
-    eset1->data = data;
+    eset = (element_set_t *)PG_GETARG_POINTER(0);
 
-    /* and finally compute the current number of elements */
-    eset1->nbytes = tmp - data;
-    eset1->nall = eset1->nbytes / eset1->item_size;
-    eset1->nsorted = eset1->nall;
+    log_set_stats(eset);
 
-    PG_RETURN_POINTER(eset1);
+    /* we only need the count, so don't build the merged array */
+    PG_RETURN_INT64(count_distinct(eset));
 }
 
+/*
+ * Final function of lrtm_count_distinct_hybrid, returns the count and whether
+ * it's exact (false if the set degraded to a sketch).
+ */
 Datum
-lrtm_count_distinct(PG_FUNCTION_ARGS)
+lrtm_count_distinct_hybrid(PG_FUNCTION_ARGS)
 {
     element_set_t * eset;
+    TupleDesc   tupdesc;
+    Datum       values[2];
+    bool        nulls[2] = {false, false};
 
-    CHECK_AGG_CONTEXT("lrtm_count_distinct", fcinfo);
+    CHECK_AGG_CONTEXT("lrtm_count_distinct_hybrid", fcinfo);
+    track_context_peak(fcinfo);
 
     if (PG_ARGISNULL(0))
         PG_RETURN_NULL();
 
+    if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+        elog(ERROR, "return type must be a row type");
+
     eset = (element_set_t *)PG_GETARG_POINTER(0);
 
-    /* do the compaction */
-    compact_set(eset, false);
+    log_set_stats(eset);
 
-#if DEBUG_PROFILE
-    print_set_stats(eset);
-#endif
+    values[0] = Int64GetDatum(count_distinct(eset));
+    values[1] = BoolGetDatum(eset->mode != SET_MODE_SKETCH);
 
-    PG_RETURN_INT64(eset->nall);
+    PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(BlessTupleDesc(tupdesc), values, nulls)));
 }
 
 Datum
-array_agg_distinct_type_by_element(PG_FUNCTION_ARGS)
+lrtm_array_agg_distinct_type_by_element(PG_FUNCTION_ARGS)
 {
     /* get element type for the dummy second parameter (anynonarray item) */
-    Oid element_type = get_fn_expr_argtype(fcinfo->flinfo, 1);
+    Oid element_type = get_element_type_cached(fcinfo, false);
 
     CHECK_AGG_CONTEXT("lrtm_count_distinct", fcinfo);
+    track_context_peak(fcinfo);
 
     /* return empty array if the state was not initialized */
     if (PG_ARGISNULL(0))
@@ -463,13 +1301,13 @@ array_agg_distinct_type_by_element(PG_FUNCTION_ARGS)
 }
 
 Datum
-array_agg_distinct_type_by_array(PG_FUNCTION_ARGS)
+lrtm_array_agg_distinct_type_by_array(PG_FUNCTION_ARGS)
 {
     /* get element type for the dummy second parameter (anyarray item) */
-    Oid input_type = get_fn_expr_argtype(fcinfo->flinfo, 1),
-        element_type = get_element_type(input_type);
+    Oid element_type = get_element_type_cached(fcinfo, true);
 
     CHECK_AGG_CONTEXT("lrtm_count_distinct", fcinfo);
+    track_context_peak(fcinfo);
 
     /* return empty array if the state was not initialized */
     if (PG_ARGISNULL(0))
@@ -478,191 +1316,5815 @@ array_agg_distinct_type_by_array(PG_FUNCTION_ARGS)
     return build_array((element_set_t *)PG_GETARG_POINTER(0), element_type);
 }
 
-static Datum
-build_array(element_set_t * eset, Oid element_type)
+/*
+ * lrtm_distinct_set is the serialized set (see set_header_t), so that the
+ * sets can be stored e.g. in rollup tables and combined later. The text form
+ * is the data in hex.
+ */
+Datum
+lrtm_distinct_set_in(PG_FUNCTION_ARGS)
 {
-    Datum * array_of_datums;
-    int i;
+    char   *str = PG_GETARG_CSTRING(0);
+    int     len = strlen(str);
+    bytea  *result;
 
-    int16       typlen;
-    bool        typbyval;
-    char        typalign;
+    if ((len % 2) != 0)
+        elog(ERROR, "invalid lrtm_distinct_set (odd number of hex digits)");
 
-    /* do the compaction */
-    compact_set(eset, false);
+    result = (bytea *) palloc(VARHDRSZ + len / 2);
+    SET_VARSIZE(result, VARHDRSZ + hex_decode(str, len, VARDATA(result)));
 
-#if DEBUG_PROFILE
-    print_set_stats(eset);
-#endif
-    
-    /* get detailed type information on the element type */
-    get_typlenbyvalalign(element_type, &typlen, &typbyval, &typalign);
+    /* make sure it's a valid set */
+    set_check_items(set_from_bytes(VARDATA(result), VARSIZE(result) - VARHDRSZ,
+                                   CurrentMemoryContext));
 
-    /* Copy data from compact array to array of Datums
-     * A bit suboptimal way, spends excessive memory
-     */
-    array_of_datums = palloc0(eset->nsorted * sizeof(Datum));
-    for (i = 0; i < eset->nsorted; i++)
-        memcpy(array_of_datums + i, eset->data + (eset->item_size * i), eset->item_size);
+    PG_RETURN_BYTEA_P(result);
+}
+
+Datum
+lrtm_distinct_set_out(PG_FUNCTION_ARGS)
+{
+    bytea  *set = PG_GETARG_BYTEA_PP(0);
+    Size    len = VARSIZE_ANY_EXHDR(set);
+    char   *result = palloc(len * 2 + 1);
 
-    /* build and return the array */
-    PG_RETURN_DATUM(PointerGetDatum(construct_array(
-        array_of_datums, eset->nsorted, element_type, typlen, typbyval, typalign
-    )));
+    result[hex_encode(VARDATA_ANY(set), len, result)] = '\0';
+
+    PG_RETURN_CSTRING(result);
 }
-static void
-compact_set(element_set_t * eset, bool need_space)
+
+Datum
+lrtm_distinct_set_recv(PG_FUNCTION_ARGS)
 {
-    char   *base = eset->data + (eset->nsorted * eset->item_size);
-    char   *last = base;
-    char   *curr;
-    int        i;
-    int        cnt = 1;
-    double    free_fract;
+    StringInfo  buf = (StringInfo) PG_GETARG_POINTER(0);
+    int         len = buf->len - buf->cursor;
+    bytea      *result;
 
-    Assert(eset->nall > 0);
-    Assert(eset->data != NULL);
-    Assert(eset->nsorted <= eset->nall);
-    Assert(eset->nall * eset->item_size <= eset->nbytes);
+    result = (bytea *) palloc(VARHDRSZ + len);
+    SET_VARSIZE(result, VARHDRSZ + len);
+    pq_copymsgbytes(buf, VARDATA(result), len);
 
-    /* if there are no new (unsorted) items, we don't need to sort */
-    if (eset->nall > eset->nsorted)
-    {
-        qsort_arg(eset->data + eset->nsorted * eset->item_size,
-                  eset->nall - eset->nsorted, eset->item_size,
-                  compare_items, &eset->item_size);
-        for (i = 1; i < eset->nall - eset->nsorted; i++)
-        {
-            curr = base + (i * eset->item_size);
+    set_check_items(set_from_bytes(VARDATA(result), len, CurrentMemoryContext));
 
-            /* items differ (keep the item) */
-            if (memcmp(last, curr, eset->item_size) != 0)
-            {
-                last += eset->item_size;
-                cnt  += 1;
+    PG_RETURN_BYTEA_P(result);
+}
 
-                /* only copy if really needed */
-                if (last != curr)
-                    memcpy(last, curr, eset->item_size);
-            }
-        }
+Datum
+lrtm_distinct_set_send(PG_FUNCTION_ARGS)
+{
+    bytea  *set = PG_GETARG_BYTEA_PP(0);
+    StringInfoData buf;
 
-        /* duplicities removed -> update the number of items in this part */
-        eset->nall = eset->nsorted + cnt;
-        if (eset->nsorted == 0)
-            eset->nsorted = eset->nall;
-        if (eset->nsorted < eset->nall)
-        {
-            MemoryContext oldctx = MemoryContextSwitchTo(eset->aggctx);
-            char * data = palloc(eset->nbytes);
-            char * ptr = data;
-            char * a = eset->data;
-            char * a_max = eset->data + eset->nsorted * eset->item_size;
-            char * b = eset->data + (eset->nsorted * eset->item_size);
-            char * b_max = eset->data + eset->nall * eset->item_size;
+    pq_begintypsend(&buf);
+    pq_sendbytes(&buf, VARDATA_ANY(set), VARSIZE_ANY_EXHDR(set));
 
-            MemoryContextSwitchTo(oldctx);
+    PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
+}
 
-            while (true)
-            {
-                int r = memcmp(a, b, eset->item_size);
-                if (r == 0)
-                {
-                    memcpy(ptr, a, eset->item_size);
-                    a += eset->item_size;
-                    b += eset->item_size;
-                }
-                else if (r < 0)
-                {
-                    memcpy(ptr, a, eset->item_size);
-                    a += eset->item_size;
-                }
-                else
-                {
-                    memcpy(ptr, b, eset->item_size);
-                    b += eset->item_size;
-                }
+/* number of distinct items in a stored set (estimated for sketches) */
+Datum
+lrtm_distinct_set_cardinality(PG_FUNCTION_ARGS)
+{
+    bytea  *set = PG_GETARG_BYTEA_PP(0);
 
-                ptr += eset->item_size;
-                if ((a == a_max) || (b == b_max))
-                {
-                    if (a != a_max)        
-                    {
-                        memcpy(ptr, a, a_max - a);
-                        ptr += (a_max - a);
-                    }
-                    else if (b != b_max)    
-                    {
-                        memcpy(ptr, b, b_max - b);
-                        ptr += (b_max - b);
-                    }
+    PG_RETURN_INT64(set_count(set_from_bytes(VARDATA_ANY(set), VARSIZE_ANY_EXHDR(set),
+                                             CurrentMemoryContext)));
+}
 
-                    break;
-                }
-            }
+/* transition function of lrtm_distinct_union, combines the stored sets */
+Datum
+lrtm_distinct_union_append(PG_FUNCTION_ARGS)
+{
+    element_set_t  *eset;
+    bytea          *set;
+    MemoryContext   aggcontext;
+
+    if (PG_ARGISNULL(1) && PG_ARGISNULL(0))
+        PG_RETURN_NULL();
+    else if (PG_ARGISNULL(1))
+        PG_RETURN_DATUM(PG_GETARG_DATUM(0));
 
-            Assert((ptr - data) <= (eset->nall * eset->item_size));
+    GET_AGG_CONTEXT("lrtm_distinct_union_append", fcinfo, aggcontext);
 
-            eset->nsorted = (ptr - data) / eset->item_size;
-            eset->nall = eset->nsorted;
-            pfree(eset->data);
-            eset->data = data;
-        }
+    eset = PG_ARGISNULL(0) ? NULL : (element_set_t *) PG_GETARG_POINTER(0);
+    set = PG_GETARG_BYTEA_PP(1);
+
+    /* the stored set is used in place, combine copies what it needs */
+    PG_RETURN_POINTER(combine_sets(fcinfo, aggcontext, eset,
+                                   set_from_bytes(VARDATA_ANY(set), VARSIZE_ANY_EXHDR(set),
+                                                  aggcontext)));
+}
+
+/*
+ * Cardinality of intersection, difference and union of two stored sets. The
+ * result is never built, the items are only counted. Sketches only allow an
+ * estimate (by inclusion-exclusion from the unioned sketch).
+ */
+Datum
+lrtm_distinct_set_intersect_count(PG_FUNCTION_ARGS)
+{
+    bytea  *set1 = PG_GETARG_BYTEA_PP(0);
+    bytea  *set2 = PG_GETARG_BYTEA_PP(1);
+    element_set_t  *eset1;
+    element_set_t  *eset2;
+
+    eset1 = set_from_bytes(VARDATA_ANY(set1), VARSIZE_ANY_EXHDR(set1), CurrentMemoryContext);
+    eset2 = set_from_bytes(VARDATA_ANY(set2), VARSIZE_ANY_EXHDR(set2), CurrentMemoryContext);
+
+    check_same_type(eset1, eset2);
+
+    if ((eset1->mode == SET_MODE_SKETCH) || (eset2->mode == SET_MODE_SKETCH))
+    {
+        double  count1 = set_count(eset1);
+        double  count2 = set_count(eset2);
+        double  estimate = count1 + count2 - sketch_union_estimate(eset1, eset2);
+
+        PG_RETURN_INT64((int64) Max(0, Min(estimate, Min(count1, count2))));
     }
 
-    Assert(eset->nall == eset->nsorted);
+    PG_RETURN_INT64(intersect_count(eset1, eset2));
+}
 
-    free_fract
-        = (eset->nbytes - eset->nall * eset->item_size) * 1.0 / eset->nbytes;
+/* number of items of the first set missing in the second one */
+Datum
+lrtm_distinct_set_difference_count(PG_FUNCTION_ARGS)
+{
+    bytea  *set1 = PG_GETARG_BYTEA_PP(0);
+    bytea  *set2 = PG_GETARG_BYTEA_PP(1);
+    element_set_t  *eset1;
+    element_set_t  *eset2;
+
+    eset1 = set_from_bytes(VARDATA_ANY(set1), VARSIZE_ANY_EXHDR(set1), CurrentMemoryContext);
+    eset2 = set_from_bytes(VARDATA_ANY(set2), VARSIZE_ANY_EXHDR(set2), CurrentMemoryContext);
 
-    if (need_space && (free_fract < ARRAY_FREE_FRACT))
+    check_same_type(eset1, eset2);
+
+    if ((eset1->mode == SET_MODE_SKETCH) || (eset2->mode == SET_MODE_SKETCH))
     {
-        if ((eset->nbytes / 0.8) < ALLOCSET_SEPARATE_THRESHOLD)
-            eset->nbytes *= 2;
-        else
-            eset->nbytes /= 0.8;
+        double  count1 = set_count(eset1);
+        double  count2 = set_count(eset2);
+        double  estimate = sketch_union_estimate(eset1, eset2) - count2;
 
-        eset->data = repalloc(eset->data, eset->nbytes);
+        PG_RETURN_INT64((int64) Max(0, Min(estimate, count1)));
     }
+
+    PG_RETURN_INT64(eset1->nall - intersect_count(eset1, eset2));
 }
 
-static void
-add_element(element_set_t * eset, char * value)
+Datum
+lrtm_distinct_set_union_count(PG_FUNCTION_ARGS)
 {
-    if (eset->item_size * (eset->nall + 1) > eset->nbytes)
-        compact_set(eset, true);
-    Assert(eset->nbytes >= eset->item_size * (eset->nall + 1));
+    bytea  *set1 = PG_GETARG_BYTEA_PP(0);
+    bytea  *set2 = PG_GETARG_BYTEA_PP(1);
+    element_set_t  *eset1;
+    element_set_t  *eset2;
 
-    memcpy(eset->data + (eset->item_size * eset->nall), value, eset->item_size);
-    eset->nall += 1;
+    eset1 = set_from_bytes(VARDATA_ANY(set1), VARSIZE_ANY_EXHDR(set1), CurrentMemoryContext);
+    eset2 = set_from_bytes(VARDATA_ANY(set2), VARSIZE_ANY_EXHDR(set2), CurrentMemoryContext);
+
+    check_same_type(eset1, eset2);
+
+    if ((eset1->mode == SET_MODE_SKETCH) || (eset2->mode == SET_MODE_SKETCH))
+        PG_RETURN_INT64((int64) (sketch_union_estimate(eset1, eset2) + 0.5));
+
+    PG_RETURN_INT64((int64) eset1->nall + eset2->nall - intersect_count(eset1, eset2));
 }
-static element_set_t *
-init_set(int item_size, char typalign, MemoryContext ctx)
+
+/*
+ * Moving-aggregate transition functions. The values are kept with their
+ * multiplicity, so that the inverse function can remove values leaving the
+ * window frame, instead of rebuilding the state for each frame.
+ */
+Datum
+lrtm_count_distinct_moving_append(PG_FUNCTION_ARGS)
 {
-    element_set_t * eset = (element_set_t *)palloc(sizeof(element_set_t));
+    counted_set_t  *cset;
+    Datum           element = PG_GETARG_DATUM(1);
+    uint64          fingerprint;
+    char           *item;
+    MemoryContext   oldcontext;
+    MemoryContext   aggcontext;
 
-    eset->item_size = item_size;
-    eset->typalign = typalign;
-    eset->nsorted = 0;
-    eset->nall = 0;
-    eset->nbytes = ARRAY_INIT_SIZE;
-    eset->aggctx = ctx;
+    if (PG_ARGISNULL(1) && PG_ARGISNULL(0))
+        PG_RETURN_NULL();
+    else if (PG_ARGISNULL(1))
+        PG_RETURN_DATUM(PG_GETARG_DATUM(0));
 
-    eset->data = palloc(eset->nbytes);
+    GET_AGG_CONTEXT("lrtm_count_distinct_moving_append", fcinfo, aggcontext);
 
-    return eset;
+    if (PG_ARGISNULL(0))
+    {
+        oldcontext = MemoryContextSwitchTo(aggcontext);
+        cset = counted_init(get_value_type_cached(fcinfo, false));
+        MemoryContextSwitchTo(oldcontext);
+    }
+    else
+        cset = (counted_set_t *) PG_GETARG_POINTER(0);
+
+    /* hashing may allocate memory, so do that in the per-tuple context */
+    item = value_to_item(&cset->vtype, &element, &fingerprint);
+
+    oldcontext = MemoryContextSwitchTo(aggcontext);
+
+    counted_add(cset, item, 1);
+
+    MemoryContextSwitchTo(oldcontext);
+
+    PG_RETURN_POINTER(cset);
 }
 
-#if DEBUG_PROFILE
-static void
-print_set_stats(element_set_t * eset)
+Datum
+lrtm_count_distinct_moving_remove(PG_FUNCTION_ARGS)
 {
-    elog(WARNING, "bytes=%d item=%d all=%d sorted=%d",
-                  eset->nbytes, eset->item_size, eset->nall, eset->nsorted);
+    counted_set_t  *cset;
+    Datum           element = PG_GETARG_DATUM(1);
+    uint64          fingerprint;
+
+    CHECK_AGG_CONTEXT("lrtm_count_distinct_moving_remove", fcinfo);
+
+    /* NULL values were not added, so there's nothing to remove */
+    if (PG_ARGISNULL(1) && PG_ARGISNULL(0))
+        PG_RETURN_NULL();
+    else if (PG_ARGISNULL(1))
+        PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+
+    if (PG_ARGISNULL(0))
+        elog(ERROR, "lrtm_count_distinct_moving_remove called with empty state");
+
+    cset = (counted_set_t *) PG_GETARG_POINTER(0);
+
+    counted_remove(cset, value_to_item(&cset->vtype, &element, &fingerprint));
+
+    PG_RETURN_POINTER(cset);
 }
-#endif
-static int
-compare_items(const void * a, const void * b, void * size)
+
+/* an empty frame has to give NULL, just like the plain aggregate */
+Datum
+lrtm_count_distinct_moving(PG_FUNCTION_ARGS)
 {
-    return memcmp(a, b, *(int*)size);
+    counted_set_t  *cset;
+
+    CHECK_AGG_CONTEXT("lrtm_count_distinct_moving", fcinfo);
+    track_context_peak(fcinfo);
+
+    if (PG_ARGISNULL(0))
+        PG_RETURN_NULL();
+
+    cset = (counted_set_t *) PG_GETARG_POINTER(0);
+
+    if (cset->nitems == 0)
+        PG_RETURN_NULL();
+
+    PG_RETURN_INT64(cset->nitems);
+}
+
+/*
+ * Grouped distinct counts - all the (group, value) pairs go into a single
+ * state, and the final function counts the distinct values of each group.
+ * With many groups that's much cheaper than a tiny set per group, as the
+ * pairs are sorted in cache-sized partitions (see grouped_compact). Rows
+ * with a NULL group or value are ignored.
+ */
+Datum
+lrtm_count_distinct_grouped_append(PG_FUNCTION_ARGS)
+{
+    grouped_state_t    *gstate;
+    grouped_pair_t     *pair;
+    Datum               element = PG_GETARG_DATUM(2);
+    uint64              fingerprint;
+    char               *item;
+    int                 item_size;
+    MemoryContext       aggcontext;
+
+    if ((PG_ARGISNULL(1) || PG_ARGISNULL(2)) && PG_ARGISNULL(0))
+        PG_RETURN_NULL();
+    else if (PG_ARGISNULL(1) || PG_ARGISNULL(2))
+        PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+
+    GET_AGG_CONTEXT("lrtm_count_distinct_grouped_append", fcinfo, aggcontext);
+
+    if (PG_ARGISNULL(0))
+    {
+        fn_cache_t *cache = get_fn_cache(fcinfo);
+
+        /* the value is the third argument (get_value_type_cached looks at the second) */
+        if (! cache->has_vtype)
+        {
+            Oid     value_type = get_fn_expr_argtype(fcinfo->flinfo, 2);
+
+            lookup_value_type(value_type, PG_GET_COLLATION(), &cache->vtype);
+
+            /*
+             * The pairs only have space for 8B values, and a hash would make
+             * the counts approximate (unlike lrtm_count_distinct, which keeps
+             * such values exactly).
+             */
+            if ((cache->vtype.kind == VALUE_BYREF) && (cache->vtype.typlen > sizeof(uint64)))
+                elog(ERROR, "lrtm_count_distinct_grouped does not support values of type %s "
+                     "(wider than 8 bytes), use lrtm_count_distinct with GROUP BY",
+                     format_type_be(value_type));
+
+            cache->has_vtype = true;
+        }
+
+        gstate = grouped_init(&cache->vtype, aggcontext, GROUPED_INIT_PAIRS);
+    }
+    else
+        gstate = (grouped_state_t *) PG_GETARG_POINTER(0);
+
+    if (gstate->npairs == gstate->maxpairs)
+        grouped_reserve(gstate, 1);
+
+    pair = &gstate->pairs[gstate->npairs++];
+    pair->group = (uint64) PG_GETARG_INT64(1);
+
+    /* hashing may allocate memory, so do that in the per-tuple context */
+    item = value_to_item(&gstate->vtype, &element, &fingerprint);
+    item_size = value_item_size(&gstate->vtype);
+
+    /* varlena values are fingerprints, everything else fits as it is */
+    Assert(item_size <= sizeof(uint64));
+
+    pair->value = 0;
+    memcpy(&pair->value, item, item_size);
+
+    PG_RETURN_POINTER(gstate);
+}
+
+/* the compacted pairs, as they are */
+Datum
+lrtm_count_distinct_grouped_serial(PG_FUNCTION_ARGS)
+{
+    grouped_state_t *gstate = (grouped_state_t *) PG_GETARG_POINTER(0);
+    Size        nbytes;
+    bytea      *out;
+
+    CHECK_AGG_CONTEXT("lrtm_count_distinct_grouped_serial", fcinfo);
+
+    grouped_compact(gstate);
+
+    nbytes = gstate->npairs * sizeof(grouped_pair_t);
+
+    if (VARHDRSZ + nbytes > MaxAllocSize)
+        elog(ERROR, "lrtm_count_distinct_grouped state too large to serialize (%zu pairs)",
+             gstate->npairs);
+
+    out = (bytea *) palloc(VARHDRSZ + nbytes);
+    SET_VARSIZE(out, VARHDRSZ + nbytes);
+    memcpy(VARDATA(out), gstate->pairs, nbytes);
+
+    PG_RETURN_BYTEA_P(out);
+}
+
+Datum
+lrtm_count_distinct_grouped_deserial(PG_FUNCTION_ARGS)
+{
+    bytea      *state = (bytea *) PG_GETARG_POINTER(0);
+    Size        len = VARSIZE_ANY_EXHDR(state);
+    Size        npairs = len / sizeof(grouped_pair_t);
+    grouped_state_t *gstate;
+
+    CHECK_AGG_CONTEXT("lrtm_count_distinct_grouped_deserial", fcinfo);
+
+    if (len % sizeof(grouped_pair_t) != 0)
+        elog(ERROR, "invalid lrtm_count_distinct_grouped state");
+
+    /* the values are already items, so the type does not matter any more */
+    gstate = grouped_init(NULL, CurrentMemoryContext, Max(npairs, 1));
+
+    memcpy(gstate->pairs, VARDATA_ANY(state), len);
+    gstate->npairs = gstate->ndistinct = npairs;
+
+    PG_RETURN_POINTER(gstate);
+}
+
+Datum
+lrtm_count_distinct_grouped_combine(PG_FUNCTION_ARGS)
+{
+    grouped_state_t *gstate1;
+    grouped_state_t *gstate2;
+    MemoryContext    agg_context;
+
+    GET_AGG_CONTEXT("lrtm_count_distinct_grouped_combine", fcinfo, agg_context);
+
+    gstate1 = PG_ARGISNULL(0) ? NULL : (grouped_state_t *) PG_GETARG_POINTER(0);
+    gstate2 = PG_ARGISNULL(1) ? NULL : (grouped_state_t *) PG_GETARG_POINTER(1);
+
+    if (gstate2 == NULL)
+        PG_RETURN_POINTER(gstate1);
+
+    if (gstate1 == NULL)
+        gstate1 = grouped_init(&gstate2->vtype, agg_context,
+                               Max(gstate2->npairs, GROUPED_INIT_PAIRS));
+
+    /* the new pairs are not compacted with the existing ones yet */
+    grouped_reserve(gstate1, gstate2->npairs);
+
+    memcpy(gstate1->pairs + gstate1->npairs, gstate2->pairs,
+           gstate2->npairs * sizeof(grouped_pair_t));
+    gstate1->npairs += gstate2->npairs;
+
+    PG_RETURN_POINTER(gstate1);
+}
+
+/*
+ * Final function of lrtm_count_distinct_grouped. After the compaction the
+ * pairs of each group are contiguous and distinct, so the counts are just
+ * the lengths of the runs. The groups are in no particular order.
+ */
+Datum
+lrtm_count_distinct_grouped(PG_FUNCTION_ARGS)
+{
+    grouped_state_t *gstate;
+    Oid         element_type;
+    TupleDesc   tupdesc;
+    Datum      *groups;
+    Size        ngroups = 0;
+    Size        i, j;
+    ArrayType  *result;
+
+    CHECK_AGG_CONTEXT("lrtm_count_distinct_grouped", fcinfo);
+    track_context_peak(fcinfo);
+
+    if (PG_ARGISNULL(0))
+        PG_RETURN_NULL();
+
+    gstate = (grouped_state_t *) PG_GETARG_POINTER(0);
+
+    element_type = get_element_type(get_fn_expr_rettype(fcinfo->flinfo));
+    if (! OidIsValid(element_type))
+        elog(ERROR, "return type must be an array of a row type");
+
+    grouped_compact(gstate);
+
+    for (i = 0; i < gstate->npairs; i++)
+        ngroups += (i == 0) || (gstate->pairs[i].group != gstate->pairs[i - 1].group);
+
+    if (ngroups > MaxArraySize)
+        elog(ERROR, "too many groups for lrtm_count_distinct_grouped (%zu)", ngroups);
+
+    tupdesc = lookup_rowtype_tupdesc(element_type, -1);
+    groups = palloc(Max(ngroups, 1) * sizeof(Datum));
+
+    ngroups = 0;
+    for (i = 0; i < gstate->npairs; i = j)
+    {
+        Datum   values[2];
+        bool    nulls[2] = {false, false};
+
+        for (j = i + 1; j < gstate->npairs; j++)
+            if (gstate->pairs[j].group != gstate->pairs[i].group)
+                break;
+
+        values[0] = Int64GetDatum((int64) gstate->pairs[i].group);
+        values[1] = Int64GetDatum((int64) (j - i));
+
+        groups[ngroups++] = HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls));
+    }
+
+    ReleaseTupleDesc(tupdesc);
+
+    result = construct_array(groups, ngroups, element_type, -1, false, 'd');
+
+    PG_RETURN_ARRAYTYPE_P(result);
+}
+
+/*
+ * Most frequent values - all the values are counted exactly (in the counted
+ * set of the moving aggregate), and the final function picks the k most
+ * frequent ones. The k is the same for all rows, it's remembered by the
+ * first call (the final functions don't get it). Rows with a NULL value are
+ * ignored.
+ */
+Datum
+lrtm_top_k_append(PG_FUNCTION_ARGS)
+{
+    counted_set_t  *cset;
+    Datum           element = PG_GETARG_DATUM(1);
+    uint64          fingerprint;
+    char           *item;
+    MemoryContext   oldcontext;
+    MemoryContext   aggcontext;
+
+    if (PG_ARGISNULL(1) && PG_ARGISNULL(0))
+        PG_RETURN_NULL();
+    else if (PG_ARGISNULL(1))
+        PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+
+    GET_AGG_CONTEXT("lrtm_top_k_append", fcinfo, aggcontext);
+
+    if (PG_ARGISNULL(0))
+    {
+        if (PG_ARGISNULL(2) || (PG_GETARG_INT32(2) <= 0))
+            elog(ERROR, "the number of values returned by lrtm_top_k has to be positive");
+
+        oldcontext = MemoryContextSwitchTo(aggcontext);
+        cset = counted_init(get_value_type_cached(fcinfo, false));
+        cset->k = PG_GETARG_INT32(2);
+        MemoryContextSwitchTo(oldcontext);
+    }
+    else
+        cset = (counted_set_t *) PG_GETARG_POINTER(0);
+
+    /* hashing may allocate memory, so do that in the per-tuple context */
+    item = value_to_item(&cset->vtype, &element, &fingerprint);
+
+    oldcontext = MemoryContextSwitchTo(aggcontext);
+
+    counted_add(cset, item, 1);
+
+    MemoryContextSwitchTo(oldcontext);
+
+    PG_RETURN_POINTER(cset);
+}
+
+/*
+ * The serialized state is k, the kind and size of the items, the number of
+ * items, and then the items followed by their counts (only the used slots).
+ */
+Datum
+lrtm_top_k_serial(PG_FUNCTION_ARGS)
+{
+    counted_set_t  *cset = (counted_set_t *) PG_GETARG_POINTER(0);
+    Size        nbytes;
+    bytea      *out;
+    char       *items;
+    uint64     *counts;
+    uint32      header[4];
+    uint32      i, n = 0;
+
+    CHECK_AGG_CONTEXT("lrtm_top_k_serial", fcinfo);
+
+    nbytes = sizeof(header) + (Size) cset->nitems * (cset->item_size + sizeof(uint64));
+
+    if (VARHDRSZ + nbytes > MaxAllocSize)
+        elog(ERROR, "lrtm_top_k state too large to serialize (%u values)", cset->nitems);
+
+    out = (bytea *) palloc(VARHDRSZ + nbytes);
+    SET_VARSIZE(out, VARHDRSZ + nbytes);
+
+    header[0] = cset->k;
+    header[1] = cset->vtype.kind;
+    header[2] = cset->item_size;
+    header[3] = cset->nitems;
+
+    memcpy(VARDATA(out), header, sizeof(header));
+
+    items = VARDATA(out) + sizeof(header);
+    counts = (uint64 *) (items + (Size) cset->nitems * cset->item_size);
+
+    for (i = 0; i < cset->nslots; i++)
+    {
+        if (cset->counts[i] == 0)
+            continue;
+
+        memcpy(items + (Size) n * cset->item_size,
+               cset->items + (Size) i * cset->item_size, cset->item_size);
+        memcpy(&counts[n], &cset->counts[i], sizeof(uint64));
+        n++;
+    }
+
+    Assert(n == cset->nitems);
+
+    PG_RETURN_BYTEA_P(out);
+}
+
+Datum
+lrtm_top_k_deserial(PG_FUNCTION_ARGS)
+{
+    bytea          *state = (bytea *) PG_GETARG_POINTER(0);
+    Size            len = VARSIZE_ANY_EXHDR(state);
+    char           *ptr = VARDATA_ANY(state);
+    counted_set_t  *cset;
+    value_type_t    vtype;
+    uint32          header[4];
+    char           *items;
+    uint32          i;
+
+    CHECK_AGG_CONTEXT("lrtm_top_k_deserial", fcinfo);
+
+    if (len < sizeof(header))
+        elog(ERROR, "invalid lrtm_top_k state");
+
+    memcpy(header, ptr, sizeof(header));
+
+    if ((header[0] == 0) || (header[1] > VALUE_FINGERPRINT) || (header[2] == 0) ||
+        (len != sizeof(header) + (Size) header[3] * (header[2] + sizeof(uint64))))
+        elog(ERROR, "invalid lrtm_top_k state");
+
+    /* only the item size matters, the final function looks up the type */
+    memset(&vtype, 0, sizeof(value_type_t));
+    vtype.kind = header[1];
+    vtype.typlen = (header[1] == VALUE_FINGERPRINT) ? -1 : header[2];
+
+    cset = counted_init(&vtype);
+    cset->k = header[0];
+
+    items = ptr + sizeof(header);
+
+    for (i = 0; i < header[3]; i++)
+    {
+        uint64  count;
+
+        memcpy(&count, items + (Size) header[3] * header[2] + i * sizeof(uint64),
+               sizeof(uint64));
+
+        counted_add(cset, items + (Size) i * header[2], count);
+    }
+
+    PG_RETURN_POINTER(cset);
+}
+
+Datum
+lrtm_top_k_combine(PG_FUNCTION_ARGS)
+{
+    counted_set_t  *cset1;
+    counted_set_t  *cset2;
+    MemoryContext   agg_context;
+    MemoryContext   old_context;
+    uint32          i;
+
+    GET_AGG_CONTEXT("lrtm_top_k_combine", fcinfo, agg_context);
+
+    cset1 = PG_ARGISNULL(0) ? NULL : (counted_set_t *) PG_GETARG_POINTER(0);
+    cset2 = PG_ARGISNULL(1) ? NULL : (counted_set_t *) PG_GETARG_POINTER(1);
+
+    if (cset2 == NULL)
+        PG_RETURN_POINTER(cset1);
+
+    old_context = MemoryContextSwitchTo(agg_context);
+
+    if (cset1 == NULL)
+    {
+        cset1 = counted_init(&cset2->vtype);
+        cset1->k = cset2->k;
+    }
+
+    if (cset1->item_size != cset2->item_size)
+        elog(ERROR, "can't combine lrtm_top_k states of different types");
+
+    for (i = 0; i < cset2->nslots; i++)
+    {
+        if (cset2->counts[i] > 0)
+            counted_add(cset1, cset2->items + (Size) i * cset2->item_size, cset2->counts[i]);
+    }
+
+    MemoryContextSwitchTo(old_context);
+
+    PG_RETURN_POINTER(cset1);
+}
+
+/*
+ * The k most frequent values, the most frequent first. Values kept only as
+ * hashes (varlena types) can't be returned, just like in array_agg_distinct.
+ * The state is not modified, so that lrtm_top_k_counts can share it.
+ */
+Datum
+lrtm_top_k(PG_FUNCTION_ARGS)
+{
+    counted_set_t  *cset;
+    value_type_t   *vtype;
+    Oid             element_type = get_element_type_cached(fcinfo, false);
+    Datum          *values;
+    uint32         *slots;
+    uint32          i, n;
+
+    CHECK_AGG_CONTEXT("lrtm_top_k", fcinfo);
+    track_context_peak(fcinfo);
+
+    if (PG_ARGISNULL(0))
+        PG_RETURN_DATUM(PointerGetDatum(construct_empty_array(element_type)));
+
+    cset = (counted_set_t *) PG_GETARG_POINTER(0);
+    vtype = get_value_type_cached(fcinfo, false);
+
+    if (vtype->kind == VALUE_FINGERPRINT)
+        elog(ERROR, "lrtm_top_k can't return values of type %s (only their hashes are kept)",
+             format_type_be(element_type));
+
+    slots = palloc(Max(Min(cset->k, cset->nitems), 1) * sizeof(uint32));
+    n = counted_top(cset, slots);
+
+    values = palloc(Max(n, 1) * sizeof(Datum));
+
+    for (i = 0; i < n; i++)
+    {
+        char   *item = cset->items + (Size) slots[i] * cset->item_size;
+
+        /* by-value items are keys, anything else the bytes of the value */
+        if (vtype->kind == VALUE_BYVAL)
+            values[i] = (Datum) key_to_value(vtype->order, cset->item_size,
+                                             load_item(item, cset->item_size));
+        else
+            values[i] = PointerGetDatum(item);
+    }
+
+    PG_RETURN_ARRAYTYPE_P(construct_array(values, n, element_type, vtype->typlen,
+                                          vtype->typbyval, vtype->typalign));
+}
+
+/* counts of the values returned by lrtm_top_k (for the same arguments) */
+Datum
+lrtm_top_k_counts(PG_FUNCTION_ARGS)
+{
+    counted_set_t  *cset;
+    Datum          *counts;
+    uint32         *slots;
+    uint32          i, n;
+
+    CHECK_AGG_CONTEXT("lrtm_top_k_counts", fcinfo);
+    track_context_peak(fcinfo);
+
+    if (PG_ARGISNULL(0))
+        PG_RETURN_DATUM(PointerGetDatum(construct_empty_array(INT8OID)));
+
+    cset = (counted_set_t *) PG_GETARG_POINTER(0);
+
+    slots = palloc(Max(Min(cset->k, cset->nitems), 1) * sizeof(uint32));
+    n = counted_top(cset, slots);
+
+    counts = palloc(Max(n, 1) * sizeof(Datum));
+
+    for (i = 0; i < n; i++)
+        counts[i] = Int64GetDatum((int64) cset->counts[slots[i]]);
+
+    PG_RETURN_ARRAYTYPE_P(construct_array(counts, n, INT8OID, sizeof(int64),
+                                          FLOAT8PASSBYVAL, 'd'));
+}
+
+/*
+ * Counters summed over all sets of the backend (since the last reset), when
+ * lrtm_count_distinct.track_stats is enabled. Parallel workers count their
+ * sets separately, so this only includes the leader's part of the work.
+ */
+Datum
+lrtm_count_distinct_stats(PG_FUNCTION_ARGS)
+{
+    TupleDesc   tupdesc;
+    Datum       values[9];
+    bool        nulls[9] = {false, false, false, false, false, false, false, false, false};
+
+    if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+        elog(ERROR, "return type must be a row type");
+
+    values[0] = Int64GetDatum(backend_stats.sets);
+    values[1] = Int64GetDatum(backend_stats.compactions);
+    values[2] = Int64GetDatum(backend_stats.items_sorted);
+    values[3] = Int64GetDatum(backend_stats.dups_removed);
+    values[4] = Int64GetDatum(backend_stats.grows);
+    values[5] = Int64GetDatum(backend_stats.combine_bytes);
+    values[6] = Int64GetDatum(backend_stats.serialized_bytes);
+    values[7] = Int64GetDatum(backend_stats.spilled_bytes);
+    values[8] = Int64GetDatum((int64) backend_peak_bytes);
+
+    PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(BlessTupleDesc(tupdesc), values, nulls)));
+}
+
+Datum
+lrtm_count_distinct_stats_reset(PG_FUNCTION_ARGS)
+{
+    memset(&backend_stats, 0, sizeof(set_stats_t));
+    backend_peak_bytes = 0;
+
+    PG_RETURN_VOID();
+}
+
+/*
+ * Approximate distinct count, using a HyperLogLog sketch. The state has a
+ * fixed size (2^precision one-byte registers) no matter how many values
+ * are added, and combining states is a register-wise max.
+ */
+Datum
+lrtm_count_distinct_approx_append(PG_FUNCTION_ARGS)
+{
+    hll_state_t    *hll;
+    Datum           element = PG_GETARG_DATUM(1);
+
+    /* memory contexts */
+    MemoryContext oldcontext;
+    MemoryContext aggcontext;
+
+    if (PG_ARGISNULL(1) && PG_ARGISNULL(0))
+        PG_RETURN_NULL();
+    else if (PG_ARGISNULL(1))
+        PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+
+    GET_AGG_CONTEXT("lrtm_count_distinct_approx_append", fcinfo, aggcontext);
+
+    if (PG_ARGISNULL(0))
+    {
+        int         precision = HLL_DEFAULT_PRECISION;
+
+        /* optional precision argument (only read for the first value) */
+        if ((PG_NARGS() > 2) && !PG_ARGISNULL(2))
+            precision = PG_GETARG_INT32(2);
+
+        if ((precision < HLL_MIN_PRECISION) || (precision > HLL_MAX_PRECISION))
+            elog(ERROR, "lrtm_count_distinct_approx precision must be between %d and %d",
+                 HLL_MIN_PRECISION, HLL_MAX_PRECISION);
+
+        oldcontext = MemoryContextSwitchTo(aggcontext);
+
+        hll = hll_init(precision);
+        hll->vtype = *get_hash_type_cached(fcinfo);
+
+        MemoryContextSwitchTo(oldcontext);
+    }
+    else
+        hll = (hll_state_t *)PG_GETARG_POINTER(0);
+
+    /* the registers are fixed-size, so this needs no allocation */
+    hll_add_hash(hll->registers, hll->precision, hash_value(&hll->vtype, element));
+
+    PG_RETURN_POINTER(hll);
+}
+
+Datum
+lrtm_count_distinct_approx_serial(PG_FUNCTION_ARGS)
+{
+    hll_state_t *hll = (hll_state_t *)PG_GETARG_POINTER(0);
+    Size    dlen = HLL_NREGISTERS(hll->precision);
+    bytea  *out;
+    char   *ptr;
+
+    CHECK_AGG_CONTEXT("lrtm_count_distinct_approx_serial", fcinfo);
+
+    /* just the precision and the registers */
+    out = (bytea *)palloc(VARHDRSZ + HLL_HEADER_BYTES + dlen);
+
+    SET_VARSIZE(out, VARHDRSZ + HLL_HEADER_BYTES + dlen);
+    ptr = VARDATA(out);
+
+    *ptr++ = (char) hll->precision;
+    memcpy(ptr, hll->registers, dlen);
+
+    PG_RETURN_BYTEA_P(out);
+}
+
+Datum
+lrtm_count_distinct_approx_deserial(PG_FUNCTION_ARGS)
+{
+    bytea  *state = (bytea *)PG_GETARG_POINTER(0);
+    Size    len = VARSIZE_ANY_EXHDR(state);
+    char   *ptr = VARDATA_ANY(state);
+    hll_state_t *hll;
+    int     precision;
+
+    CHECK_AGG_CONTEXT("lrtm_count_distinct_approx_deserial", fcinfo);
+
+    if (len < HLL_HEADER_BYTES)
+        elog(ERROR, "invalid lrtm_count_distinct_approx state (too short)");
+
+    precision = (uint8) ptr[0];
+
+    if ((precision < HLL_MIN_PRECISION) || (precision > HLL_MAX_PRECISION) ||
+        (len != HLL_HEADER_BYTES + HLL_NREGISTERS(precision)))
+        elog(ERROR, "invalid lrtm_count_distinct_approx state");
+
+    /* values are never added to deserialized states */
+    hll = hll_init(precision);
+    memcpy(hll->registers, ptr + HLL_HEADER_BYTES, HLL_NREGISTERS(precision));
+
+    PG_RETURN_POINTER(hll);
+}
+
+Datum
+lrtm_count_distinct_approx_combine(PG_FUNCTION_ARGS)
+{
+    uint32  i;
+    hll_state_t *hll1;
+    hll_state_t *hll2;
+    MemoryContext agg_context;
+
+    GET_AGG_CONTEXT("lrtm_count_distinct_approx_combine", fcinfo, agg_context);
+
+    hll1 = PG_ARGISNULL(0) ? NULL : (hll_state_t *) PG_GETARG_POINTER(0);
+    hll2 = PG_ARGISNULL(1) ? NULL : (hll_state_t *) PG_GETARG_POINTER(1);
+
+    if (hll2 == NULL)
+        PG_RETURN_POINTER(hll1);
+
+    if (hll1 == NULL)
+    {
+        hll1 = MemoryContextAlloc(agg_context, HLL_STATE_SIZE(hll2->precision));
+        memcpy(hll1, hll2, HLL_STATE_SIZE(hll2->precision));
+
+        PG_RETURN_POINTER(hll1);
+    }
+
+    if (hll1->precision != hll2->precision)
+        elog(ERROR, "cannot combine lrtm_count_distinct_approx states with different precision");
+
+    for (i = 0; i < HLL_NREGISTERS(hll1->precision); i++)
+        hll1->registers[i] = Max(hll1->registers[i], hll2->registers[i]);
+
+    PG_RETURN_POINTER(hll1);
+}
+
+Datum
+lrtm_count_distinct_approx(PG_FUNCTION_ARGS)
+{
+    hll_state_t *hll;
+
+    CHECK_AGG_CONTEXT("lrtm_count_distinct_approx", fcinfo);
+    track_context_peak(fcinfo);
+
+    if (PG_ARGISNULL(0))
+        PG_RETURN_NULL();
+
+    hll = (hll_state_t *)PG_GETARG_POINTER(0);
+
+    PG_RETURN_INT64((int64) (hll_estimate(hll->registers, hll->precision) + 0.5));
+}
+
+static Datum
+build_array(element_set_t * eset, Oid element_type)
+{
+    ArrayType  *result;
+    char       *ptr;
+    Size        stride;
+    Size        nbytes;
+    int         i;
+
+    /* do the compaction (the array needs all the items in memory anyway) */
+    if (eset->spill != NULL)
+        set_unspill(eset);
+
+    compact_set(eset, false);
+
+    if (eset->mode == SET_MODE_SKETCH)
+        elog(ERROR, "the set degraded to a sketch, so the distinct values are not available");
+
+    log_set_stats(eset);
+
+    if (eset->vtype.kind == VALUE_FINGERPRINT)
+        elog(ERROR, "lrtm_array_agg_distinct can't return values of type %s (only their hashes are kept)",
+             format_type_be(element_type));
+
+    /*
+     * The items are fixed-length and sorted, so we can lay out the array
+     * directly - a 1-D array without NULLs is just the header followed by
+     * the items, each aligned to typalign. Without any padding that's just
+     * a copy of the compacted data (or the keys of the bits set).
+     */
+    stride = att_align_nominal(eset->item_size, eset->vtype.typalign);
+
+    if ((eset->mode == SET_MODE_BITMAP) && (stride != eset->item_size))
+        bitmap_to_array(eset);
+    nbytes = ARR_OVERHEAD_NONULLS(1) + (Size) eset->nsorted * stride;
+
+    if (! AllocSizeIsValid(nbytes))
+        elog(ERROR, "array size exceeds the maximum allowed (%d)", (int) MaxAllocSize);
+
+    result = (ArrayType *) palloc(nbytes);
+    memset(result, 0, ARR_OVERHEAD_NONULLS(1));
+
+    SET_VARSIZE(result, nbytes);
+    result->ndim = 1;
+    result->dataoffset = 0;
+    result->elemtype = element_type;
+    ARR_DIMS(result)[0] = eset->nsorted;
+    ARR_LBOUND(result)[0] = 1;
+
+    ptr = ARR_DATA_PTR(result);
+
+    if (eset->mode == SET_MODE_BITMAP)
+        bitmap_items(eset, ptr);
+    else if (stride == eset->item_size)
+        memcpy(ptr, eset->data, (Size) eset->nsorted * eset->item_size);
+    else
+    {
+        for (i = 0; i < eset->nsorted; i++)
+        {
+            memcpy(ptr, eset->data + (Size) i * eset->item_size, eset->item_size);
+            memset(ptr + eset->item_size, 0, stride - eset->item_size);
+            ptr += stride;
+        }
+    }
+
+    /* turn the keys back into values (integers and floats have no padding) */
+    if (eset->vtype.order != VALUE_ORDER_UNSIGNED)
+    {
+        Assert(stride == eset->item_size);
+
+        ptr = ARR_DATA_PTR(result);
+        for (i = 0; i < eset->nsorted; i++)
+        {
+            store_item(ptr, eset->item_size,
+                       key_to_value(eset->vtype.order, eset->item_size,
+                                    load_item(ptr, eset->item_size)));
+            ptr += eset->item_size;
+        }
+    }
+
+    PG_RETURN_ARRAYTYPE_P(result);
+}
+/*
+ * Turn the set into two sorted parts of distinct items - the sorted prefix
+ * and the tail (sorted in place and with duplicities removed). The hash table
+ * becomes the tail, with an empty prefix.
+ */
+static void
+sort_tail(element_set_t * eset)
+{
+    char   *base;
+    int     ntail;
+
+    Assert(! eset->readonly);
+
+    /* the hash table becomes a single unsorted (but distinct) part */
+    if (eset->mode == SET_MODE_HASH)
+        hash_to_array(eset);
+
+    /* if there are no new (unsorted) items, we don't need to sort */
+    if (eset->nall == eset->nsorted)
+        return;
+
+    base = eset->data + (eset->nsorted * eset->item_size);
+    ntail = eset->nall - eset->nsorted;
+
+    eset->sort_items(eset, base, ntail);
+
+    /* duplicities removed -> update the number of items in this part */
+    eset->nall = eset->nsorted + dedup_items(eset, base, ntail);
+    if (eset->nsorted == 0)
+        eset->nsorted = eset->nall;
+}
+
+/*
+ * Scratch buffer with at least nbytes, kept in the set so that compactions
+ * don't need to go through the allocator every time.
+ */
+static char *
+set_scratch(element_set_t * eset, Size nbytes)
+{
+    if (eset->scratch_bytes < nbytes)
+    {
+        if (eset->scratch != NULL)
+            pfree(eset->scratch);
+
+        eset->scratch = MemoryContextAlloc(eset->aggctx, nbytes);
+        eset->scratch_bytes = nbytes;
+    }
+
+    return eset->scratch;
+}
+
+/* merge the two parts backwards, from the largest items (any item size) */
+static char *
+merge_backward_generic(const char * prefix, Size * na, const char * tail, Size * nb,
+                       char * out, int item_size)
+{
+    while ((*na > 0) && (*nb > 0))
+    {
+        const char *a = prefix + (*na - 1) * item_size;
+        const char *b = tail + (*nb - 1) * item_size;
+        int         r = compare_values(a, b, item_size);
+
+        out -= item_size;
+
+        if (r > 0)
+        {
+            memcpy(out, a, item_size);
+            (*na)--;
+        }
+        else
+        {
+            memcpy(out, b, item_size);
+            (*nb)--;
+
+            /* the item is in both parts */
+            if (r == 0)
+                (*na)--;
+        }
+    }
+
+    return out;
+}
+
+/*
+ * Branchless backward merge for 4/8B items - the larger item is written, and
+ * the part it came from advances (both parts for an item in both of them).
+ */
+#define DEFINE_MERGE_BACKWARD(width, type) \
+static char * \
+merge_backward_##width(const char * prefix, Size * na, const char * tail, Size * nb, \
+                       char * out) \
+{ \
+    const type *a = (const type *) prefix; \
+    const type *b = (const type *) tail; \
+    type       *o = (type *) out; \
+    Size        i = *na, j = *nb; \
+ \
+    while ((i > 0) && (j > 0)) \
+    { \
+        type    x = a[i - 1]; \
+        type    y = b[j - 1]; \
+ \
+        *--o = (x > y) ? x : y; \
+        i -= (x >= y); \
+        j -= (y >= x); \
+    } \
+ \
+    *na = i; \
+    *nb = j; \
+ \
+    return (char *) o; \
+}
+
+DEFINE_MERGE_BACKWARD(4, uint32)
+DEFINE_MERGE_BACKWARD(8, uint64)
+
+/*
+ * Merge the sorted prefix with the sorted tail (both distinct), in place.
+ *
+ * The tail is moved out of the way - to the free space at the end of the
+ * array if there's enough of it, to the scratch buffer otherwise - and the
+ * two parts are merged backwards, from the largest items. The output never
+ * overtakes the unread part of the prefix, so no new array is needed. Items
+ * present in both parts leave a gap before the output, removed at the end.
+ */
+static void
+merge_tail(element_set_t * eset)
+{
+    int     item_size = eset->item_size;
+    Size    ntail = eset->nall - eset->nsorted;
+    Size    tail_bytes = ntail * item_size;
+    char   *tail;
+    char   *out, *start, *end;
+    Size    na, nb;
+
+    Assert(eset->nsorted < eset->nall);
+
+    /* (aligned to the item size, for the typed merge kernels) */
+    if (eset->nbytes - (Size) eset->nall * item_size >= tail_bytes)
+        tail = eset->data + ((eset->nbytes - tail_bytes) / item_size) * item_size;
+    else
+        tail = set_scratch(eset, tail_bytes);
+
+    memmove(tail, eset->data + (Size) eset->nsorted * item_size, tail_bytes);
+
+    /* remaining items in both parts, and the end of the output */
+    na = eset->nsorted;
+    nb = ntail;
+    out = eset->data + (Size) eset->nall * item_size;
+
+    switch (item_size)
+    {
+        case 4:
+            out = merge_backward_4(eset->data, &na, tail, &nb, out);
+            break;
+        case 8:
+            out = merge_backward_8(eset->data, &na, tail, &nb, out);
+            break;
+        default:
+            out = merge_backward_generic(eset->data, &na, tail, &nb, out, item_size);
+            break;
+    }
+
+    /* the rest of the tail goes right before the output */
+    if (nb > 0)
+    {
+        out -= nb * item_size;
+        memcpy(out, tail, nb * item_size);
+    }
+
+    /*
+     * The rest of the prefix is already in place, so close the gap left by
+     * the duplicate items by moving the output right after it.
+     */
+    end = eset->data + (Size) eset->nall * item_size;
+    start = eset->data + na * item_size;
+
+    if (out != start)
+    {
+        memmove(start, out, end - out);
+        end = start + (end - out);
+    }
+
+    eset->nall = eset->nsorted = (end - eset->data) / item_size;
+}
+
+static void
+compact_set(element_set_t * eset, bool need_space)
+{
+    double    free_fract;
+    uint32    nall, ntail;
+    Size      ninput;
+    uint32    i;
+
+    /* sketch has nothing to compact (but may need a copy to be modified) */
+    if (eset->mode == SET_MODE_SKETCH)
+    {
+        if (eset->readonly && need_space)
+            set_materialize(eset);
+
+        return;
+    }
+
+    /* neither has a bitmap (a bit set twice is still one item) */
+    if (eset->mode == SET_MODE_BITMAP)
+        return;
+
+    Assert((eset->nall > 0) || (eset->spill != NULL));
+    Assert(eset->data != NULL);
+    Assert(eset->nsorted <= eset->nall);
+    Assert(eset->nall * eset->item_size <= eset->nbytes);
+
+    /* deserialized state, we need our own (decoded) copy */
+    if (eset->readonly)
+        set_materialize(eset);
+
+    nall = eset->nall;
+    ntail = eset->nall - eset->nsorted;
+
+    /* items of the runs count as input too (for the stats) */
+    ninput = nall;
+    for (i = 0; i < eset->nruns; i++)
+        ninput += eset->runs[i].nitems;
+
+    /* switching from a hash table means most of the items were new */
+    if (eset->mode == SET_MODE_HASH)
+        eset->few_dups = true;
+
+    sort_tail(eset);
+
+    /* merge the sorted prefix with the tail (in place) */
+    if (eset->nsorted < eset->nall)
+        merge_tail(eset);
+
+    Assert(eset->nall == eset->nsorted);
+
+    if (ntail > 0)
+        eset->few_dups = ((nall - eset->nall) < ntail * ARRAY_FEW_DUPS_FRACT);
+
+    /* merge the sorted runs collected by combine */
+    if (eset->nruns > 0)
+        merge_runs(eset);
+
+    SET_STATS_ADD(eset, compactions, 1);
+    SET_STATS_ADD(eset, items_sorted, ntail);
+    SET_STATS_ADD(eset, dups_removed, ninput - eset->nall);
+
+    /* don't keep scratch space much larger than the usual tail */
+    if (eset->scratch_bytes > eset->nbytes * SCRATCH_KEEP_FRACT)
+    {
+        pfree(eset->scratch);
+        eset->scratch = NULL;
+        eset->scratch_bytes = 0;
+    }
+
+    /* the distinct keys may be dense enough for a bitmap (with plenty of space) */
+    if (set_to_bitmap(eset))
+        return;
+
+    free_fract
+        = (eset->nbytes - eset->nall * eset->item_size) * 1.0 / eset->nbytes;
+
+    /* over the memory limit, so give up on the exact set (or spill it) */
+    if (need_space && (free_fract < ARRAY_FREE_FRACT) && (! grow_set(eset)))
+    {
+        if (eset->max_bytes > 0)
+            set_to_sketch(eset);
+        else
+            set_spill(eset);
+    }
+}
+
+/*
+ * Grow the array - small arrays and arrays that don't have many duplicates
+ * double, large arrays grow by 25%. Returns false (without growing) if that
+ * would exceed the memory limit, or if the array can't get any larger (so
+ * the caller spills the items, even without a limit).
+ */
+static bool
+grow_set(element_set_t * eset)
+{
+    Size    nbytes;
+    Size    limit = set_memory_limit(eset);
+
+    Assert(eset->mode == SET_MODE_ARRAY);
+    Assert(! eset->readonly);
+
+    if (eset->few_dups || ((eset->nbytes / 0.8) < ALLOCSET_SEPARATE_THRESHOLD))
+        nbytes = (Size) eset->nbytes * 2;
+    else
+        nbytes = eset->nbytes / 0.8;
+
+    nbytes = Min(nbytes, MaxAllocSize);
+
+    /* sets that spill may still use the memory up to the limit */
+    if ((limit > 0) && (nbytes > limit))
+    {
+        if ((eset->max_bytes > 0) || (eset->nbytes >= limit))
+            return false;
+
+        nbytes = limit;
+    }
+
+    /* already at MaxAllocSize */
+    if (nbytes <= eset->nbytes)
+        return false;
+
+    set_resize_data(eset, nbytes);
+
+    SET_STATS_ADD(eset, grows, 1);
+
+    return true;
+}
+
+/*
+ * Add a value to an ordered set (e.g. fed from an index scan or a sorted
+ * subquery). A value equal to the last item is a duplicate, a larger one
+ * extends the sorted part, so there's nothing to sort or merge later. The
+ * first smaller value ends the ordered mode, and returns false to add the
+ * value the usual way.
+ */
+static inline bool
+add_ordered(element_set_t * eset, char * value)
+{
+    int     item_size = eset->item_size;
+
+    /* combine or a batch of array elements may have added unsorted items */
+    if ((eset->mode != SET_MODE_ARRAY) || (eset->nsorted != eset->nall))
+    {
+        set_end_ordered(eset);
+        return false;
+    }
+
+    if (eset->nall > 0)
+    {
+        int     r = compare_values(value, eset->data + (Size) (eset->nall - 1) * item_size,
+                                   item_size);
+
+        if (r == 0)
+        {
+            SET_STATS_ADD(eset, dups_removed, 1);
+            return true;
+        }
+
+        if (r < 0)
+        {
+            set_end_ordered(eset);
+            return false;
+        }
+    }
+
+    /*
+     * Dense keys (e.g. a serial column) become a bitmap. Over the memory
+     * limit the compaction spills the items (and the set stays ordered,
+     * with the next items in the array), or degrades to a sketch.
+     */
+    if ((Size) item_size * (eset->nall + 1) > eset->nbytes)
+    {
+        if (set_to_bitmap(eset))
+        {
+            eset->ordered = false;
+            return false;
+        }
+
+        if (! grow_set(eset))
+        {
+            compact_set(eset, true);
+
+            if (eset->mode != SET_MODE_ARRAY)
+            {
+                eset->ordered = false;
+                return false;
+            }
+        }
+    }
+
+    memcpy(eset->data + (Size) eset->nall * item_size, value, item_size);
+    eset->nall += 1;
+    eset->nsorted += 1;
+
+    return true;
+}
+
+/*
+ * The input is not ordered after all, so continue the way an unordered set
+ * would - a small set of a width we can hash becomes a hash table, otherwise
+ * the items stay as the sorted part of the array.
+ */
+static void
+set_end_ordered(element_set_t * eset)
+{
+    int     item_size = eset->item_size;
+
+    eset->ordered = false;
+
+    if ((eset->mode != SET_MODE_ARRAY) || (eset->nsorted != eset->nall) ||
+        (eset->nruns > 0) || (eset->spill != NULL) || eset->readonly)
+        return;
+
+    if ((item_size == 1 || item_size == 2 || item_size == 4 || item_size == 8) &&
+        (eset->nall < HASH_MIN_SWITCH_ITEMS))
+        array_to_hash(eset);
+}
+
+static void
+add_element(element_set_t * eset, char * value)
+{
+    if (eset->ordered && add_ordered(eset, value))
+        return;
+
+    if (eset->readonly)
+        set_materialize(eset);
+
+    if (eset->mode == SET_MODE_SKETCH)
+    {
+        hll_add_hash((uint8 *) eset->data, HLL_DEFAULT_PRECISION,
+                     hash_item(value, eset->item_size));
+        return;
+    }
+
+    if (eset->mode == SET_MODE_HASH)
+    {
+        hash_add_element(eset, value);
+        return;
+    }
+
+    /* a key out of the range of a bitmap may need to go to an array */
+    if (eset->mode == SET_MODE_BITMAP)
+    {
+        if (bitmap_add(eset, value))
+            return;
+
+        bitmap_to_array(eset);
+    }
+
+    /*
+     * When the last compaction found few duplicates, sorting the tail again
+     * would not free much space, so just grow the array (until the tail gets
+     * as long as the sorted part).
+     */
+    if (eset->item_size * (eset->nall + 1) > eset->nbytes)
+    {
+        if (! (eset->few_dups && (eset->nall - eset->nsorted < eset->nsorted) &&
+               grow_set(eset)))
+            compact_set(eset, true);
+    }
+
+    /* the compaction may have hit the memory limit (or made a bitmap) */
+    if (eset->mode == SET_MODE_SKETCH)
+    {
+        hll_add_hash((uint8 *) eset->data, HLL_DEFAULT_PRECISION,
+                     hash_item(value, eset->item_size));
+        return;
+    }
+
+    if (eset->mode == SET_MODE_BITMAP)
+    {
+        add_element(eset, value);
+        return;
+    }
+
+    Assert(eset->nbytes >= eset->item_size * (eset->nall + 1));
+
+    memcpy(eset->data + (eset->item_size * eset->nall), value, eset->item_size);
+    eset->nall += 1;
+}
+
+/*
+ * Add a batch of contiguous values (as stored in an array, i.e. not turned
+ * into keys yet, see VALUE_ORDER_SIGNED). In the array mode the space for the whole
+ * batch is made at once (compacting at most once), and the items are copied
+ * with a single memcpy. Hash tables and sketches still add the items one by
+ * one, but without any per-item overhead.
+ */
+static void
+add_elements(element_set_t * eset, char * items, int nitems)
+{
+    int     i;
+    Size    nbytes = (Size) nitems * eset->item_size;
+
+    if (eset->readonly)
+        set_materialize(eset);
+
+    /* the batch goes to the unsorted part (or a hash table) */
+    if (eset->ordered)
+        set_end_ordered(eset);
+
+    if ((eset->mode == SET_MODE_ARRAY) &&
+        ((Size) eset->nall * eset->item_size + nbytes > eset->nbytes))
+    {
+        /* grow without compacting, just like add_element */
+        if (! (eset->few_dups && (eset->nall - eset->nsorted < eset->nsorted) &&
+               grow_set(eset)))
+            compact_set(eset, true);
+
+        while ((eset->mode == SET_MODE_ARRAY) &&
+               ((Size) eset->nall * eset->item_size + nbytes > eset->nbytes))
+        {
+            if (! grow_set(eset))
+                break;
+        }
+    }
+
+    if ((eset->mode == SET_MODE_ARRAY) &&
+        ((Size) eset->nall * eset->item_size + nbytes <= eset->nbytes))
+    {
+        char   *ptr = eset->data + (Size) eset->nall * eset->item_size;
+
+        memcpy(ptr, items, nbytes);
+        keys_from_values(eset->vtype.order, eset->item_size, ptr, nitems);
+
+        eset->nall += nitems;
+        return;
+    }
+
+    /* hash table, sketch, or an array over the memory limit */
+    for (i = 0; i < nitems; i++)
+    {
+        char   *item = items + (Size) i * eset->item_size;
+        uint64  key;
+
+        if (eset->vtype.order != VALUE_ORDER_UNSIGNED)
+        {
+            store_item((char *) &key, eset->item_size,
+                       value_to_key(eset->vtype.order, eset->item_size,
+                                    load_item(item, eset->item_size)));
+            item = (char *) &key;
+        }
+
+        if (eset->mode == SET_MODE_HASH)
+            hash_add_element(eset, item);
+        else
+            add_element(eset, item);
+    }
+}
+
+/* number of non-NULL elements of an array, using the NULL bitmap */
+static int
+array_count_nonnull(bits8 * null_bitmap, int nitems)
+{
+    int     nbytes = nitems / 8;
+    int     count;
+
+    count = pg_popcount((const char *) null_bitmap, nbytes);
+
+    /* the remaining bits of the last byte */
+    if (nitems % 8)
+        count += pg_number_of_ones[null_bitmap[nbytes] & ((1 << (nitems % 8)) - 1)];
+
+    return count;
+}
+/* size of the items stored in the set (fingerprints for the varlena types) */
+static inline int
+value_item_size(value_type_t * vtype)
+{
+    return (vtype->kind == VALUE_FINGERPRINT) ? sizeof(uint64) : vtype->typlen;
+}
+
+/*
+ * Initial size of a new set (in bytes), either set by initial_bytes, or
+ * derived from the planner estimates - the input rows per group are an upper
+ * bound for the distinct values in the group. Without an estimate (e.g. in
+ * window aggregates) we start small.
+ *
+ * The number of groups is often underestimated (and the sets are then
+ * preallocated for many more groups than expected), so with grouping the
+ * estimate is used only for a few groups, and with a much lower limit.
+ */
+static Size
+initial_set_bytes(FunctionCallInfo fcinfo, value_type_t * vtype)
+{
+    AggState   *aggstate;
+    Agg        *agg;
+    Plan       *outer;
+    double      rows;
+
+    if (initial_bytes != INITIAL_BYTES_AUTO)
+        return initial_bytes;
+
+    if ((fcinfo->context == NULL) || (! IsA(fcinfo->context, AggState)))
+        return ARRAY_INIT_SIZE;
+
+    aggstate = (AggState *) fcinfo->context;
+    agg = (Agg *) aggstate->ss.ps.plan;
+
+    if ((agg == NULL) || (outerPlan(agg) == NULL))
+        return ARRAY_INIT_SIZE;
+
+    outer = outerPlan(agg);
+
+    if (agg->aggstrategy == AGG_PLAIN)
+        return (Size) Min(outer->plan_rows * value_item_size(vtype), AUTO_INIT_MAX_BYTES);
+
+    if ((agg->numGroups <= 0) || (agg->numGroups > AUTO_INIT_MAX_GROUPS))
+        return ARRAY_INIT_SIZE;
+
+    rows = outer->plan_rows / agg->numGroups * value_item_size(vtype);
+
+    return (Size) Min(rows, AUTO_INIT_GROUP_BYTES);
+}
+
+/*
+ * Allocates a new set with (roughly) init_bytes of space. A hash table has
+ * a power-of-two number of slots, with enough of them to keep the fill
+ * factor below HASH_MAX_FILL. The header comes from the arena (if any), and
+ * small sets keep the data inline.
+ */
+static element_set_t *
+init_set(value_type_t * vtype, MemoryContext ctx, Size init_bytes, set_arena_t * arena)
+{
+    element_set_t * eset = (element_set_t *) set_arena_alloc(arena, sizeof(element_set_t));
+    int     item_size = value_item_size(vtype);
+
+    eset->item_size = item_size;
+    eset->vtype = *vtype;
+    eset->nsorted = 0;
+    eset->nall = 0;
+    eset->aggctx = ctx;
+    eset->sort_items = choose_sort_kernel(item_size);
+
+    /*
+     * Start as an ordered array, until the first value out of order. Then
+     * widths we can hash directly switch to a hash table, so size the array
+     * as the table would be. All 1B keys fit into a bitmap in the header.
+     */
+    eset->mode = SET_MODE_ARRAY;
+    eset->ordered = true;
+    eset->base = 0;
+
+    init_bytes = Min(Max(init_bytes, ARRAY_INIT_SIZE), MaxAllocSize / 2);
+
+    if (item_size == 1 || item_size == 2 || item_size == 4 || item_size == 8)
+    {
+        uint32  nslots = ARRAY_INIT_SIZE / item_size;
+
+        while (nslots * HASH_MAX_FILL * item_size < init_bytes)
+            nslots *= 2;
+
+        eset->nbytes = nslots * item_size;
+    }
+    else
+        eset->nbytes = init_bytes;
+
+    if ((item_size == 1) && (vtype->kind != VALUE_FINGERPRINT))
+    {
+        eset->mode = SET_MODE_BITMAP;
+        eset->ordered = false;
+        eset->nbytes = 256 / 8;
+    }
+
+    eset->has_zero = false;
+    eset->hash_inputs = 0;
+    eset->hash_new = 0;
+    eset->max_bytes = 0;
+    eset->readonly = false;
+    eset->encoding = SET_ENCODING_RAW;
+    eset->runs = NULL;
+    eset->nruns = 0;
+    eset->maxruns = 0;
+    eset->runs_bytes = 0;
+    eset->spill = NULL;
+    eset->stats = NULL;
+
+    if (track_stats || log_stats)
+    {
+        eset->stats = MemoryContextAllocZero(ctx, sizeof(set_stats_t));
+        backend_stats.sets++;
+    }
+    eset->scratch = NULL;
+    eset->scratch_bytes = 0;
+    eset->few_dups = false;
+
+    /* zeroed, as in the hash mode that marks empty slots */
+    if (eset->nbytes <= SET_INLINE_BYTES)
+    {
+        eset->data = (char *) eset->inline_data;
+        memset(eset->data, 0, eset->nbytes);
+    }
+    else
+        eset->data = palloc0(eset->nbytes);
+
+    return eset;
+}
+
+static inline bool
+item_is_zero(const char * item, int item_size)
+{
+    int     i;
+
+    for (i = 0; i < item_size; i++)
+        if (item[i] != 0)
+            return false;
+
+    return true;
+}
+
+/* murmur3 finalizer - good enough mixing for fixed-width keys */
+static inline uint64
+hash_key(uint64 key)
+{
+    key ^= key >> 33;
+    key *= UINT64CONST(0xff51afd7ed558ccd);
+    key ^= key >> 33;
+    key *= UINT64CONST(0xc4ceb9fe1a85ec53);
+    key ^= key >> 33;
+
+    return key;
+}
+
+/* MurmurHash64A, for values passed by reference */
+static uint64
+hash_bytes64(const char * data, int len)
+{
+    const uint64    m = UINT64CONST(0xc6a4a7935bd1e995);
+    uint64          h = (uint64) len * m;
+    const char     *end = data + (len & ~7);
+
+    while (data != end)
+    {
+        uint64  k;
+
+        memcpy(&k, data, sizeof(uint64));
+        data += sizeof(uint64);
+
+#ifdef WORDS_BIGENDIAN
+        /* same hash on all machines (fingerprints get serialized) */
+        k = pg_bswap64(k);
+#endif
+
+        k *= m;
+        k ^= k >> 47;
+        k *= m;
+
+        h ^= k;
+        h *= m;
+    }
+
+    switch (len & 7)
+    {
+        case 7: h ^= (uint64) (uint8) data[6] << 48;    /* fall through */
+        case 6: h ^= (uint64) (uint8) data[5] << 40;    /* fall through */
+        case 5: h ^= (uint64) (uint8) data[4] << 32;    /* fall through */
+        case 4: h ^= (uint64) (uint8) data[3] << 24;    /* fall through */
+        case 3: h ^= (uint64) (uint8) data[2] << 16;    /* fall through */
+        case 2: h ^= (uint64) (uint8) data[1] << 8;     /* fall through */
+        case 1: h ^= (uint64) (uint8) data[0];
+                h *= m;
+    }
+
+    h ^= h >> 47;
+    h *= m;
+    h ^= h >> 47;
+
+    return h;
+}
+
+/*
+ * 64-bit hash of a datum of any type. Values passed by value are hashed as
+ * integers (masked to the type length), anything else as bytes.
+ */
+static uint64
+hash_datum(Datum value, int16 typlen, bool typbyval)
+{
+    uint64          hash;
+    struct varlena *v;
+
+    if (typbyval)
+    {
+        uint64  key = DatumGetUInt64(value);
+
+        if (typlen < (int16) sizeof(uint64))
+            key &= (UINT64CONST(1) << (8 * typlen)) - 1;
+
+        return hash_key(key);
+    }
+
+    if (typlen > 0)
+        return hash_bytes64(DatumGetPointer(value), typlen);
+
+    if (typlen == -2)
+        return hash_bytes64(DatumGetCString(value), strlen(DatumGetCString(value)));
+
+    /* varlena - hash the detoasted data, without the header */
+    v = PG_DETOAST_DATUM_PACKED(value);
+    hash = hash_bytes64(VARDATA_ANY(v), VARSIZE_ANY_EXHDR(v));
+
+    if ((Pointer) v != DatumGetPointer(value))
+        pfree(v);
+
+    return hash;
+}
+
+/*
+ * Look up the type information, and decide how to store the values as
+ * fixed-width items (see value_type_t).
+ */
+static void
+lookup_value_type(Oid element_type, Oid collation, value_type_t * vtype)
+{
+    if (! try_lookup_value_type(element_type, collation, vtype))
+        elog(ERROR, "could not identify an extended hash function for type %s",
+             format_type_be(element_type));
+}
+
+/*
+ * Same as lookup_value_type, but returns false for types that are neither
+ * equalimage nor hashable (so the sets can't store them). The vtype is
+ * still usable by hash_value, which then hashes the datum bytes.
+ */
+static bool
+try_lookup_value_type(Oid element_type, Oid collation, value_type_t * vtype)
+{
+    TypeCacheEntry *typentry;
+    bool            equalimage = false;
+
+    get_typlenbyvalalign(element_type, &vtype->typlen, &vtype->typbyval, &vtype->typalign);
+
+    vtype->hash_proc = NULL;
+    vtype->collation = collation;
+    vtype->order = VALUE_ORDER_UNSIGNED;
+    vtype->typid = getBaseType(element_type);
+
+    if (vtype->typbyval)
+    {
+        vtype->kind = VALUE_BYVAL;
+
+        switch (vtype->typid)
+        {
+            case INT2OID:
+            case INT4OID:
+            case INT8OID:
+            case DATEOID:
+            case TIMEOID:
+            case TIMESTAMPOID:
+            case TIMESTAMPTZOID:
+            case CASHOID:
+                vtype->order = VALUE_ORDER_SIGNED;
+                break;
+            case FLOAT4OID:
+            case FLOAT8OID:
+                vtype->order = VALUE_ORDER_FLOAT;
+                break;
+        }
+
+        return true;
+    }
+
+    typentry = lookup_type_cache(element_type,
+                                 TYPECACHE_BTREE_OPFAMILY | TYPECACHE_HASH_EXTENDED_PROC_FINFO);
+
+#if PG_VERSION_NUM >= 130000
+    /* are equal values guaranteed to be binary equal? */
+    if (OidIsValid(typentry->btree_opf))
+    {
+        Oid     proc = get_opfamily_proc(typentry->btree_opf,
+                                         typentry->btree_opintype,
+                                         typentry->btree_opintype,
+                                         BTEQUALIMAGE_PROC);
+
+        if (OidIsValid(proc))
+            equalimage = DatumGetBool(OidFunctionCall1Coll(proc, collation,
+                                                           ObjectIdGetDatum(typentry->btree_opintype)));
+    }
+#endif
+
+    if (equalimage)
+    {
+        /* the bytes are enough, keep fixed-length values as they are */
+        vtype->kind = (vtype->typlen > 0) ? VALUE_BYREF : VALUE_FINGERPRINT;
+        return true;
+    }
+
+    vtype->kind = VALUE_FINGERPRINT;
+
+    if (! OidIsValid(typentry->hash_extended_proc_finfo.fn_oid))
+        return false;
+
+    vtype->hash_proc = &typentry->hash_extended_proc_finfo;
+    return true;
+}
+
+/* 64-bit hash of a value, consistent with the type's equality */
+static uint64
+hash_value(value_type_t * vtype, Datum value)
+{
+    if (vtype->hash_proc != NULL)
+        return DatumGetUInt64(FunctionCall2Coll(vtype->hash_proc, vtype->collation,
+                                                value, UInt64GetDatum(0)));
+
+    return hash_datum(value, vtype->typlen, vtype->typbyval);
+}
+
+/*
+ * Pointer to the set item for a value - the value itself, or the fingerprint
+ * (stored in the provided buffer).
+ */
+static char *
+value_to_item(value_type_t * vtype, Datum * value, uint64 * fingerprint)
+{
+    switch (vtype->kind)
+    {
+        case VALUE_BYVAL:
+#ifndef WORDS_BIGENDIAN
+            /* the low-order bytes of the datum come first */
+            if (vtype->order == VALUE_ORDER_UNSIGNED)
+                return (char *) value;
+#endif
+
+            /* the key is stored in the fingerprint buffer */
+            store_item((char *) fingerprint, vtype->typlen,
+                       value_to_key(vtype->order, vtype->typlen,
+                                    (uint64) *value & ITEM_MASK(vtype->typlen)));
+            return (char *) fingerprint;
+        case VALUE_BYREF:
+            return DatumGetPointer(*value);
+        case VALUE_FINGERPRINT:
+            *fingerprint = hash_value(vtype, *value);
+            return (char *) fingerprint;
+    }
+
+    elog(ERROR, "unknown value kind %d", vtype->kind);
+    return NULL;        /* keep compiler quiet */
+}
+
+static hll_state_t *
+hll_init(int precision)
+{
+    hll_state_t *hll = (hll_state_t *)palloc0(HLL_STATE_SIZE(precision));
+
+    hll->precision = precision;
+
+    return hll;
+}
+
+/*
+ * The first precision bits pick the register, the rank is the position of
+ * the leftmost 1-bit in the remaining bits.
+ */
+static inline void
+hll_add_hash(uint8 * registers, int precision, uint64 hash)
+{
+    uint32  idx = hash >> (64 - precision);
+    uint64  rest = (hash << precision) | (UINT64CONST(1) << (precision - 1));
+    uint8   rank = 64 - pg_leftmost_one_pos64(rest);
+
+    if (rank > registers[idx])
+        registers[idx] = rank;
+}
+
+/*
+ * Standard HyperLogLog estimate, with linear counting for small cardinalities.
+ * With a 64-bit hash there's no need for the large-range correction.
+ */
+static double
+hll_estimate(const uint8 * registers, int precision)
+{
+    uint32  i;
+    uint32  m = HLL_NREGISTERS(precision);
+    uint32  nzeros = 0;
+    double  sum = 0;
+    double  alpha;
+    double  estimate;
+
+    for (i = 0; i < m; i++)
+    {
+        sum += ldexp(1.0, -registers[i]);
+        nzeros += (registers[i] == 0);
+    }
+
+    switch (m)
+    {
+        case 16:
+            alpha = 0.673;
+            break;
+        case 32:
+            alpha = 0.697;
+            break;
+        case 64:
+            alpha = 0.709;
+            break;
+        default:
+            alpha = 0.7213 / (1.0 + 1.079 / m);
+    }
+
+    estimate = alpha * m * m / sum;
+
+    if ((estimate <= 2.5 * m) && (nzeros > 0))
+        estimate = m * log((double) m / nzeros);
+
+    return estimate;
+}
+
+/* hash of a set item, matching hash_datum for values passed by value */
+static inline uint64
+hash_item(const char * item, int item_size)
+{
+    uint64  key = 0;
+
+    if (item_size > sizeof(uint64))
+        return hash_bytes64(item, item_size);
+
+    memcpy(&key, item, item_size);
+
+    return hash_key(key);
+}
+
+/*
+ * Replace the exact set with a HyperLogLog sketch (with the default
+ * precision), built from all the items. Duplicates in the unsorted part
+ * don't matter, as adding a hash is idempotent.
+ */
+static void
+set_to_sketch(element_set_t * eset)
+{
+    uint8  *registers;
+    uint32  i;
+
+    if (eset->mode == SET_MODE_SKETCH)
+        return;
+
+    if (eset->readonly)
+        set_materialize(eset);
+
+    /* the runs from combine have to be included too */
+    if (eset->nruns > 0)
+        compact_set(eset, false);
+
+    registers = MemoryContextAllocZero(eset->aggctx,
+                                       HLL_NREGISTERS(HLL_DEFAULT_PRECISION));
+
+    if (eset->mode == SET_MODE_HASH)
+    {
+        uint32  nslots = eset->nbytes / eset->item_size;
+
+        for (i = 0; i < nslots; i++)
+        {
+            char   *slot = eset->data + i * eset->item_size;
+
+            if (! item_is_zero(slot, eset->item_size))
+                hll_add_hash(registers, HLL_DEFAULT_PRECISION,
+                             hash_item(slot, eset->item_size));
+        }
+
+        if (eset->has_zero)
+            hll_add_hash(registers, HLL_DEFAULT_PRECISION, hash_key(0));
+    }
+    else if (eset->mode == SET_MODE_BITMAP)
+    {
+        uint64 *words = (uint64 *) eset->data;
+
+        for (i = 0; i < eset->nbytes / sizeof(uint64); i++)
+        {
+            uint64  word = words[i];
+
+            while (word != 0)
+            {
+                uint64  item;
+
+                store_item((char *) &item, eset->item_size,
+                           eset->base + (uint64) i * 64 + pg_rightmost_one_pos64(word));
+                hll_add_hash(registers, HLL_DEFAULT_PRECISION,
+                             hash_item((char *) &item, eset->item_size));
+
+                word &= (word - 1);
+            }
+        }
+    }
+    else
+    {
+        for (i = 0; i < eset->nall; i++)
+            hll_add_hash(registers, HLL_DEFAULT_PRECISION,
+                         hash_item(eset->data + i * eset->item_size, eset->item_size));
+    }
+
+    /* the spilled items are hashed as they are read */
+    if (eset->spill != NULL)
+    {
+        run_reader_t   *readers;
+        int             nreaders;
+        int             j;
+
+        readers = palloc(eset->spill->nruns * sizeof(run_reader_t));
+        nreaders = spill_init_readers(eset, readers, 0);
+
+        for (j = 0; j < nreaders; j++)
+        {
+            while (reader_next(&readers[j]))
+                hll_add_hash(registers, HLL_DEFAULT_PRECISION,
+                             hash_item(readers[j].item, eset->item_size));
+
+            pfree(readers[j].chunk);
+        }
+
+        pfree(readers);
+
+        spill_free(eset);
+    }
+
+    set_free_data(eset);
+
+    if (eset->scratch != NULL)
+        pfree(eset->scratch);
+
+    eset->scratch = NULL;
+    eset->scratch_bytes = 0;
+
+    eset->mode = SET_MODE_SKETCH;
+    eset->data = (char *) registers;
+    eset->nbytes = HLL_NREGISTERS(HLL_DEFAULT_PRECISION);
+    eset->nall = 0;
+    eset->nsorted = 0;
+    eset->has_zero = false;
+}
+
+/* number of distinct items in a compacted set (estimated for sketches) */
+static int64
+set_count(element_set_t * eset)
+{
+    if (eset->mode == SET_MODE_SKETCH)
+        return (int64) (hll_estimate((uint8 *) eset->data, HLL_DEFAULT_PRECISION) + 0.5);
+
+    Assert(eset->nall == eset->nsorted);
+
+    return eset->nall;
+}
+
+/*
+ * Insert a non-zero value into a linear-probing table with (mask + 1) slots,
+ * returns true if the value was not there yet. The slots are a plain array
+ * of keys, so a probe sequence usually stays within a single cache line.
+ */
+#define DEFINE_HASH_ADD(width, type) \
+static inline bool \
+hash_add_##width(char * table, uint32 mask, type value) \
+{ \
+    type   *slots = (type *) table; \
+    uint32  idx = hash_key((uint64) value) & mask; \
+ \
+    while (true) \
+    { \
+        if (slots[idx] == value) \
+            return false; \
+ \
+        if (slots[idx] == 0) \
+        { \
+            slots[idx] = value; \
+            return true; \
+        } \
+ \
+        idx = (idx + 1) & mask; \
+    } \
+}
+
+DEFINE_HASH_ADD(1, uint8)
+DEFINE_HASH_ADD(2, uint16)
+DEFINE_HASH_ADD(4, uint32)
+DEFINE_HASH_ADD(8, uint64)
+
+static inline bool
+hash_add_value(char * table, uint32 mask, int item_size, char * value)
+{
+    /* values passed by reference may not be aligned */
+    switch (item_size)
+    {
+        case 1:
+            return hash_add_1(table, mask, *(uint8 *) value);
+        case 2:
+        {
+            uint16  v;
+            memcpy(&v, value, sizeof(uint16));
+            return hash_add_2(table, mask, v);
+        }
+        case 4:
+        {
+            uint32  v;
+            memcpy(&v, value, sizeof(uint32));
+            return hash_add_4(table, mask, v);
+        }
+        case 8:
+        {
+            uint64  v;
+            memcpy(&v, value, sizeof(uint64));
+            return hash_add_8(table, mask, v);
+        }
+    }
+
+    elog(ERROR, "unexpected item size %d for hash mode", item_size);
+    return false;       /* keep compiler quiet */
+}
+
+static void
+hash_add_element(element_set_t * eset, char * value)
+{
+    uint32  nslots = eset->nbytes / eset->item_size;
+
+    eset->hash_inputs += 1;
+
+    if (item_is_zero(value, eset->item_size))
+    {
+        if (! eset->has_zero)
+        {
+            eset->has_zero = true;
+            eset->nall += 1;
+            eset->hash_new += 1;
+        }
+        return;
+    }
+
+    if ((eset->nall + 1) > nslots * HASH_MAX_FILL)
+    {
+        /*
+         * Most of the recent values were new, so the duplicates are not
+         * frequent enough for the hash table to pay off. Switch to the
+         * sorted array for good.
+         */
+        if ((eset->nall >= HASH_MIN_SWITCH_ITEMS) &&
+            (eset->hash_new > eset->hash_inputs * HASH_MAX_NEW_FRACT))
+        {
+            compact_set(eset, false);
+            add_element(eset, value);
+            return;
+        }
+
+        /*
+         * A larger table would be over the memory limit, so switch to the
+         * (denser) sorted array. That degrades to a sketch (or spills) if
+         * needed.
+         */
+        if ((set_memory_limit(eset) > 0) && ((Size) eset->nbytes * 2 > set_memory_limit(eset)))
+        {
+            compact_set(eset, false);
+            add_element(eset, value);
+            return;
+        }
+
+        /* dense keys are better off as a bitmap than in a larger table */
+        if (set_to_bitmap(eset))
+        {
+            add_element(eset, value);
+            return;
+        }
+
+        hash_grow(eset);
+        nslots = eset->nbytes / eset->item_size;
+
+        SET_STATS_ADD(eset, grows, 1);
+    }
+
+    if (hash_add_value(eset->data, nslots - 1, eset->item_size, value))
+    {
+        eset->nall += 1;
+        eset->hash_new += 1;
+    }
+}
+
+/* double the hash table and rehash the items */
+static void
+hash_grow(element_set_t * eset)
+{
+    char   *old = eset->data;
+    uint32  old_nslots = eset->nbytes / eset->item_size;
+    uint32  nslots = old_nslots * 2;
+    uint32  i;
+
+    eset->data = MemoryContextAllocZero(eset->aggctx, eset->nbytes * 2);
+    eset->nbytes *= 2;
+
+    for (i = 0; i < old_nslots; i++)
+    {
+        char   *slot = old + i * eset->item_size;
+
+        if (! item_is_zero(slot, eset->item_size))
+            hash_add_value(eset->data, nslots - 1, eset->item_size, slot);
+    }
+
+    if (old != (char *) eset->inline_data)
+        pfree(old);
+
+    eset->hash_inputs = 0;
+    eset->hash_new = 0;
+}
+
+/*
+ * Move the occupied slots to the beginning of the table, which makes it an
+ * array with a single unsorted part (the items are distinct, though).
+ */
+static void
+hash_to_array(element_set_t * eset)
+{
+    uint32  nslots = eset->nbytes / eset->item_size;
+    char   *dst = eset->data;
+    uint32  i;
+
+    for (i = 0; i < nslots; i++)
+    {
+        char   *slot = eset->data + i * eset->item_size;
+
+        if (item_is_zero(slot, eset->item_size))
+            continue;
+
+        if (dst != slot)
+            memcpy(dst, slot, eset->item_size);
+
+        dst += eset->item_size;
+    }
+
+    if (eset->has_zero)
+    {
+        memset(dst, 0, eset->item_size);
+        dst += eset->item_size;
+    }
+
+    Assert((dst - eset->data) == eset->nall * eset->item_size);
+
+    eset->mode = SET_MODE_ARRAY;
+    eset->has_zero = false;
+    eset->nsorted = 0;
+}
+
+/*
+ * Turn an array with a single sorted part into a hash table (with at least
+ * as many slots as the array had space for items), see set_end_ordered.
+ */
+static void
+array_to_hash(element_set_t * eset)
+{
+    int     item_size = eset->item_size;
+    uint32  nslots = ARRAY_INIT_SIZE / item_size;
+    Size    nbytes = (Size) eset->nall * item_size;
+    uint64  local[SET_INLINE_BYTES / sizeof(uint64)];
+    char   *items;
+    uint32  i;
+
+    Assert(eset->mode == SET_MODE_ARRAY);
+    Assert(eset->nall == eset->nsorted);
+
+    while (((Size) nslots * item_size < eset->nbytes) ||
+           (eset->nall + 1 > nslots * HASH_MAX_FILL))
+        nslots *= 2;
+
+    /* the same amount of space, so rebuild the table in place */
+    if ((Size) nslots * item_size == eset->nbytes)
+    {
+        items = (nbytes <= sizeof(local)) ? (char *) local : palloc(nbytes);
+        memcpy(items, eset->data, nbytes);
+        memset(eset->data, 0, eset->nbytes);
+    }
+    else
+    {
+        items = eset->data;
+        eset->data = MemoryContextAllocZero(eset->aggctx, (Size) nslots * item_size);
+        eset->nbytes = nslots * item_size;
+    }
+
+    for (i = 0; i < eset->nall; i++)
+    {
+        char   *item = items + (Size) i * item_size;
+
+        if (item_is_zero(item, item_size))
+            eset->has_zero = true;
+        else
+            hash_add_value(eset->data, nslots - 1, item_size, item);
+    }
+
+    if ((items != (char *) local) && (items != (char *) eset->inline_data))
+        pfree(items);
+
+    eset->mode = SET_MODE_HASH;
+    eset->nsorted = 0;
+    eset->hash_inputs = 0;
+    eset->hash_new = 0;
+}
+
+/*
+ * Switch a set of distinct items (a hash table, or a compacted array) to a
+ * bitmap, when the keys are dense enough - the bitmap covering the range of
+ * the keys has to fit into the set header, or be at most BITMAP_MAX_FRACT of
+ * the array. Returns true if the set is a bitmap now.
+ */
+static bool
+set_to_bitmap(element_set_t * eset)
+{
+    int     item_size = eset->item_size;
+    uint64  local[SET_INLINE_BYTES / sizeof(uint64)];
+    uint64 *words;
+    uint64  first = ~UINT64CONST(0);
+    uint64  last = 0;
+    uint64  nwords;
+    Size    nbytes;
+    Size    limit = set_memory_limit(eset);
+    uint32  i;
+
+    if ((item_size != 1 && item_size != 2 && item_size != 4 && item_size != 8) ||
+        (eset->vtype.kind == VALUE_FINGERPRINT) || eset->readonly ||
+        (eset->nruns > 0) || (eset->spill != NULL) || (eset->nall == 0))
+        return false;
+
+    if (eset->mode == SET_MODE_ARRAY)
+    {
+        if (eset->nsorted != eset->nall)
+            return false;
+
+        first = load_item(eset->data, item_size);
+        last = load_item(eset->data + (Size) (eset->nall - 1) * item_size, item_size);
+    }
+    else if (eset->mode == SET_MODE_HASH)
+    {
+        uint32  nslots = eset->nbytes / item_size;
+
+        if (eset->has_zero)
+            first = 0;
+
+        for (i = 0; i < nslots; i++)
+        {
+            uint64  key = load_item(eset->data + (Size) i * item_size, item_size);
+
+            if (key == 0)
+                continue;
+
+            first = Min(first, key);
+            last = Max(last, key);
+        }
+    }
+    else
+        return false;
+
+    nwords = (last / 64) - (first / 64) + 1;
+
+    if ((nwords * sizeof(uint64) > SET_INLINE_BYTES) &&
+        ((double) nwords * sizeof(uint64) > (double) eset->nall * item_size * BITMAP_MAX_FRACT))
+        return false;
+
+    nbytes = nwords * sizeof(uint64);
+
+    if ((limit > 0) && (nbytes > limit))
+        return false;
+
+    words = (nbytes <= SET_INLINE_BYTES) ? local : MemoryContextAlloc(eset->aggctx, nbytes);
+    memset(words, 0, nbytes);
+
+    first -= (first % 64);
+
+    if (eset->mode == SET_MODE_ARRAY)
+    {
+        for (i = 0; i < eset->nall; i++)
+        {
+            uint64  offset = load_item(eset->data + (Size) i * item_size, item_size) - first;
+
+            words[offset / 64] |= (UINT64CONST(1) << (offset % 64));
+        }
+    }
+    else
+    {
+        uint32  nslots = eset->nbytes / item_size;
+
+        for (i = 0; i < nslots; i++)
+        {
+            uint64  key = load_item(eset->data + (Size) i * item_size, item_size);
+
+            if (key != 0)
+                words[(key - first) / 64] |= (UINT64CONST(1) << ((key - first) % 64));
+        }
+
+        /* the zero key is below any other, so it's the first bit */
+        if (eset->has_zero)
+            words[0] |= 1;
+    }
+
+    set_replace_data(eset, (char *) words, nbytes);
+
+    if (eset->scratch != NULL)
+        pfree(eset->scratch);
+
+    eset->scratch = NULL;
+    eset->scratch_bytes = 0;
+
+    eset->mode = SET_MODE_BITMAP;
+    eset->base = first;
+    eset->nsorted = eset->nall;
+    eset->has_zero = false;
+    eset->hash_inputs = 0;
+    eset->hash_new = 0;
+
+    return true;
+}
+
+/*
+ * Turn a bitmap into a sorted array of the keys, with the free space a
+ * compaction would leave.
+ */
+static void
+bitmap_to_array(element_set_t * eset)
+{
+    uint64  local[SET_INLINE_BYTES / sizeof(uint64)];
+    char   *data;
+    Size    nbytes = (Size) eset->nall * eset->item_size;
+
+    Assert(eset->mode == SET_MODE_BITMAP);
+
+    if (nbytes > MaxAllocSize)
+        elog(ERROR, "the set is too large to be loaded into memory (%u items)", eset->nall);
+
+    nbytes = Min(Max((Size) (nbytes / (1 - ARRAY_FREE_FRACT)), ARRAY_INIT_SIZE), MaxAllocSize);
+
+    data = (nbytes <= SET_INLINE_BYTES) ? (char *) local : MemoryContextAlloc(eset->aggctx, nbytes);
+
+    bitmap_items(eset, data);
+
+    set_replace_data(eset, data, nbytes);
+
+    eset->mode = SET_MODE_ARRAY;
+    eset->base = 0;
+    eset->nsorted = eset->nall;
+}
+
+/*
+ * Set the bit of the value's key, extending the bitmap if needed. Returns
+ * false (without adding the value) when the key is too far from the range
+ * (see bitmap_extend).
+ */
+static inline bool
+bitmap_add(element_set_t * eset, const char * value)
+{
+    uint64  key = load_item(value, eset->item_size);
+    uint64  offset = key - eset->base;
+    uint64  bit;
+    uint64 *word;
+
+    /* keys below the base wrap around to large offsets */
+    if (offset >= (uint64) eset->nbytes * 8)
+    {
+        if (! bitmap_extend(eset, key))
+            return false;
+
+        offset = key - eset->base;
+    }
+
+    word = (uint64 *) eset->data + offset / 64;
+    bit = UINT64CONST(1) << (offset % 64);
+
+    if (*word & bit)
+    {
+        SET_STATS_ADD(eset, dups_removed, 1);
+        return true;
+    }
+
+    *word |= bit;
+    eset->nall += 1;
+    eset->nsorted += 1;
+
+    return true;
+}
+
+/*
+ * Extend the bitmap to cover the key. The bitmap grows by half its size in
+ * that direction, so that keys arriving in order don't resize every time.
+ * Returns false when that (or just covering the key) would make it larger
+ * than an array of the items, or go over the memory limit.
+ */
+static bool
+bitmap_extend(element_set_t * eset, uint64 key)
+{
+    uint64  local[SET_INLINE_BYTES / sizeof(uint64)];
+    uint64 *words;
+    uint64  first = eset->base / 64;
+    uint64  nwords = eset->nbytes / sizeof(uint64);
+    uint64  last = first + nwords - 1;
+    uint64  word = key / 64;
+    uint64  new_first;
+    uint64  new_last;
+    Size    maxbytes;
+    Size    nbytes;
+    Size    limit = set_memory_limit(eset);
+
+    maxbytes = Max((Size) (eset->nall + 1) * eset->item_size, SET_INLINE_BYTES);
+    maxbytes = Min(maxbytes, MaxAllocSize);
+
+    if ((limit > 0) && (maxbytes > limit))
+        maxbytes = limit;
+
+    if (word > last)
+    {
+        new_first = first;
+        new_last = Min(Max(word, last + nwords / 2), ITEM_MASK(eset->item_size) / 64);
+    }
+    else
+    {
+        new_first = Min(word, first - Min(first, nwords / 2));
+        new_last = last;
+    }
+
+    /* without the extra space, it may still fit */
+    if ((new_last - new_first + 1) * sizeof(uint64) > maxbytes)
+    {
+        new_first = Min(word, first);
+        new_last = Max(word, last);
+    }
+
+    if ((new_last - new_first + 1) * sizeof(uint64) > maxbytes)
+        return false;
+
+    nbytes = (new_last - new_first + 1) * sizeof(uint64);
+
+    words = (nbytes <= SET_INLINE_BYTES) ? local : MemoryContextAlloc(eset->aggctx, nbytes);
+    memset(words, 0, nbytes);
+    memcpy(words + (first - new_first), eset->data, eset->nbytes);
+
+    set_replace_data(eset, (char *) words, nbytes);
+
+    eset->base = new_first * 64;
+
+    SET_STATS_ADD(eset, grows, 1);
+
+    return true;
+}
+
+/*
+ * Add all items of another (exact) set into a bitmap - a bitmap is ORed into
+ * it, items of other sets are added one by one. Returns false if some items
+ * don't fit (the bitmap keeps the items added so far).
+ */
+static bool
+bitmap_add_set(element_set_t * eset, element_set_t * src)
+{
+    run_reader_t    reader;
+
+    Assert(eset->mode == SET_MODE_BITMAP);
+    Assert(src->spill == NULL);
+
+    if (! src->readonly)
+        compact_set(src, false);
+
+    if (src->mode == SET_MODE_BITMAP)
+    {
+        uint64 *words;
+        uint64 *src_words = (uint64 *) src->data;
+        uint64  src_last = src->base + ((uint64) src->nbytes * 8 - 1);
+        uint64  nwords = src->nbytes / sizeof(uint64);
+        uint64  i;
+
+        /* make the bitmap cover both ends of the other one */
+        if ((src->base - eset->base >= (uint64) eset->nbytes * 8) &&
+            (! bitmap_extend(eset, src->base)))
+            return false;
+
+        if ((src_last - eset->base >= (uint64) eset->nbytes * 8) &&
+            (! bitmap_extend(eset, src_last)))
+            return false;
+
+        words = (uint64 *) eset->data + (src->base - eset->base) / 64;
+
+        for (i = 0; i < nwords; i++)
+            words[i] |= src_words[i];
+
+        eset->nall = eset->nsorted = pg_popcount(eset->data, eset->nbytes);
+
+        return true;
+    }
+
+    Assert(src->mode == SET_MODE_ARRAY);
+    Assert(src->nall == src->nsorted);
+
+    reader_init(&reader, src);
+
+    while (reader_next(&reader))
+    {
+        if (! bitmap_add(eset, reader.item))
+            return false;
+    }
+
+    return true;
+}
+
+/* write the keys of the bits set as items, in increasing order */
+static void
+bitmap_items(element_set_t * eset, char * out)
+{
+    uint64 *words = (uint64 *) eset->data;
+    int     item_size = eset->item_size;
+    uint32  i;
+
+    for (i = 0; i < eset->nbytes / sizeof(uint64); i++)
+    {
+        uint64  word = words[i];
+
+        while (word != 0)
+        {
+            store_item(out, item_size, eset->base + (uint64) i * 64 + pg_rightmost_one_pos64(word));
+            out += item_size;
+
+            word &= (word - 1);
+        }
+    }
+}
+
+static int
+compare_items(const void * a, const void * b, void * size)
+{
+    return memcmp(a, b, *(int*)size);
+}
+
+/*
+ * Compare two items the same way the sorting kernels order them. Widths
+ * handled by the radix kernels are compared as unsigned integers, anything
+ * else falls back to memcmp (matching compare_items).
+ */
+static inline int
+compare_values(const char * a, const char * b, int size)
+{
+    switch (size)
+    {
+        case 1:
+            return (int) *(uint8 *) a - (int) *(uint8 *) b;
+        case 2:
+        {
+            uint16  x, y;
+            memcpy(&x, a, sizeof(uint16));
+            memcpy(&y, b, sizeof(uint16));
+            return (x > y) - (x < y);
+        }
+        case 4:
+        {
+            uint32  x, y;
+            memcpy(&x, a, sizeof(uint32));
+            memcpy(&y, b, sizeof(uint32));
+            return (x > y) - (x < y);
+        }
+        case 8:
+        {
+            uint64  x, y;
+            memcpy(&x, a, sizeof(uint64));
+            memcpy(&y, b, sizeof(uint64));
+            return (x > y) - (x < y);
+        }
+        default:
+            return memcmp(a, b, size);
+    }
+}
+
+/* generic kernel - used for widths without a specialized radix sort */
+static void
+sort_items_generic(element_set_t * eset, char * data, int nitems)
+{
+    qsort_arg(data, nitems, eset->item_size, compare_items, &eset->item_size);
+}
+
+/* 1B items - counting sort, the value is the whole key so no scratch needed */
+static void
+sort_items_1(element_set_t * eset, char * data, int nitems)
+{
+    uint32  counts[256];
+    uint8  *items = (uint8 *) data;
+    int     i, j;
+
+    memset(counts, 0, sizeof(counts));
+
+    for (i = 0; i < nitems; i++)
+        counts[items[i]]++;
+
+    for (i = 0; i < 256; i++)
+        for (j = 0; j < counts[i]; j++)
+            *items++ = (uint8) i;
+}
+
+/*
+ * LSD radix sort for 2/4/8B items, one pass per byte. The histograms for all
+ * the passes are built in a single scan, and passes where all the items land
+ * in the same bucket are skipped (so e.g. small int8 values only need a few
+ * passes). Short runs are handled by insertion sort, as the histogram setup
+ * would dominate. The scratch buffer is kept in the set (see set_scratch).
+ *
+ * With large tails each LSD pass would scatter the items all over memory
+ * (missing the cache and TLB on every write), so runs larger than
+ * RADIX_BLOCK_BYTES are first partitioned by their highest differing byte
+ * (MSD), until the buckets fit into cache. Only those scatter passes go
+ * through memory, the LSD passes sort one bucket at a time.
+ */
+#define DEFINE_RADIX_SORT(width, type) \
+static type * \
+radix_passes_##width(type * src, type * dst, Size nitems, int nbytes) \
+{ \
+    type   *tmp; \
+    Size    counts[width][256]; \
+    Size    i; \
+    int     d; \
+ \
+    memset(counts, 0, sizeof(counts)); \
+ \
+    for (i = 0; i < nitems; i++) \
+        for (d = 0; d < nbytes; d++) \
+            counts[d][(src[i] >> (8 * d)) & 0xFF]++; \
+ \
+    for (d = 0; d < nbytes; d++) \
+    { \
+        Size    offset = 0; \
+ \
+        /* all items have the same byte, so the pass would not change anything */ \
+        if (counts[d][(src[0] >> (8 * d)) & 0xFF] == nitems) \
+            continue; \
+ \
+        for (i = 0; i < 256; i++) \
+        { \
+            Size    cnt = counts[d][i]; \
+            counts[d][i] = offset; \
+            offset += cnt; \
+        } \
+ \
+        for (i = 0; i < nitems; i++) \
+            dst[counts[d][(src[i] >> (8 * d)) & 0xFF]++] = src[i]; \
+ \
+        tmp = src; \
+        src = dst; \
+        dst = tmp; \
+    } \
+ \
+    /* the buffer with the sorted items */ \
+    return src; \
+} \
+ \
+static void \
+radix_blocked_##width(type * items, type * scratch, Size nitems) \
+{ \
+    Size    offsets[257]; \
+    Size    next[256]; \
+    type    diff = 0; \
+    Size    i; \
+    int     d; \
+ \
+    if (nitems * sizeof(type) <= RADIX_BLOCK_BYTES) \
+    { \
+        type   *sorted = radix_passes_##width(items, scratch, nitems, width); \
+ \
+        if (sorted != items) \
+            memcpy(items, sorted, nitems * sizeof(type)); \
+        return; \
+    } \
+ \
+    for (i = 1; i < nitems; i++) \
+        diff |= items[i] ^ items[0]; \
+ \
+    if (diff == 0) \
+        return; \
+ \
+    for (d = width - 1; ((diff >> (8 * d)) & 0xFF) == 0; d--) \
+        ; \
+ \
+    memset(offsets, 0, sizeof(offsets)); \
+ \
+    for (i = 0; i < nitems; i++) \
+        offsets[((items[i] >> (8 * d)) & 0xFF) + 1]++; \
+ \
+    for (i = 0; i < 256; i++) \
+        offsets[i + 1] += offsets[i]; \
+ \
+    memcpy(next, offsets, sizeof(next)); \
+ \
+    for (i = 0; i < nitems; i++) \
+        scratch[next[(items[i] >> (8 * d)) & 0xFF]++] = items[i]; \
+ \
+    /* the buckets only differ in the lower bytes, sort them back into place */ \
+    for (i = 0; i < 256; i++) \
+    { \
+        Size    start = offsets[i]; \
+        Size    n = offsets[i + 1] - start; \
+        type   *sorted; \
+ \
+        if (n == 0) \
+            continue; \
+ \
+        if (n * sizeof(type) > RADIX_BLOCK_BYTES) \
+        { \
+            memcpy(items + start, scratch + start, n * sizeof(type)); \
+            radix_blocked_##width(items + start, scratch + start, n); \
+            continue; \
+        } \
+ \
+        sorted = radix_passes_##width(scratch + start, items + start, n, d); \
+ \
+        if (sorted != items + start) \
+            memcpy(items + start, sorted, n * sizeof(type)); \
+    } \
+} \
+ \
+static void \
+sort_items_##width(element_set_t * eset, char * data, int nitems) \
+{ \
+    type   *items = (type *) data; \
+    type   *scratch; \
+    int     i; \
+ \
+    if (nitems < RADIX_SORT_MIN_ITEMS) \
+    { \
+        for (i = 1; i < nitems; i++) \
+        { \
+            type    v = items[i]; \
+            int     j = i; \
+ \
+            while ((j > 0) && (items[j - 1] > v)) \
+            { \
+                items[j] = items[j - 1]; \
+                j--; \
+            } \
+            items[j] = v; \
+        } \
+        return; \
+    } \
+ \
+    scratch = (type *) set_scratch(eset, nitems * sizeof(type)); \
+ \
+    radix_blocked_##width(items, scratch, nitems); \
+}
+
+DEFINE_RADIX_SORT(2, uint16)
+DEFINE_RADIX_SORT(4, uint32)
+DEFINE_RADIX_SORT(8, uint64)
+
+static sort_items_fn
+choose_sort_kernel(int item_size)
+{
+    switch (item_size)
+    {
+        case 1:
+            return sort_items_1;
+        case 2:
+            return sort_items_2;
+        case 4:
+            return sort_items_4;
+        case 8:
+            return sort_items_8;
+        default:
+            return sort_items_generic;
+    }
+}
+
+/* remove duplicates from the tail sorted by sort_items */
+static int
+dedup_items(element_set_t * eset, char * data, int nitems)
+{
+    switch (eset->item_size)
+    {
+        case 1:
+            return dedup_items_1(data, nitems);
+        case 2:
+            return dedup_items_2(data, nitems);
+        case 4:
+            return dedup_kernel_4(data, nitems);
+        case 8:
+            return dedup_kernel_8(data, nitems);
+        default:
+            return dedup_items_generic(data, nitems, eset->item_size);
+    }
+}
+
+static int
+dedup_items_generic(char * data, int nitems, int item_size)
+{
+    char   *last = data;
+    char   *curr;
+    int     i;
+    int     cnt = 1;
+
+    if (nitems == 0)
+        return 0;
+
+    for (i = 1; i < nitems; i++)
+    {
+        curr = data + (Size) i * item_size;
+
+        /* items differ (keep the item) */
+        if (memcmp(last, curr, item_size) != 0)
+        {
+            last += item_size;
+            cnt  += 1;
+
+            /* only copy if really needed */
+            if (last != curr)
+                memcpy(last, curr, item_size);
+        }
+    }
+
+    return cnt;
+}
+
+/*
+ * Scalar dedup for 1/2/4/8B items. Each item is stored right after the last
+ * distinct one, and the output advances only if it differs from the previous
+ * item, so there's no branch to mispredict.
+ */
+#define DEFINE_DEDUP(width, type) \
+static int \
+dedup_items_##width(char * data, int nitems) \
+{ \
+    type   *items = (type *) data; \
+    type    prev; \
+    int     i, n = 1; \
+ \
+    if (nitems == 0) \
+        return 0; \
+ \
+    prev = items[0]; \
+ \
+    for (i = 1; i < nitems; i++) \
+    { \
+        type    v = items[i]; \
+ \
+        items[n] = v; \
+        n += (v != prev); \
+        prev = v; \
+    } \
+ \
+    return n; \
+}
+
+DEFINE_DEDUP(1, uint8)
+DEFINE_DEDUP(2, uint16)
+DEFINE_DEDUP(4, uint32)
+DEFINE_DEDUP(8, uint64)
+
+#ifdef USE_AVX2_DEDUP
+
+/*
+ * Permutations moving the lanes selected by a mask to the front of the
+ * vector (AVX2 has no compress-store), as 32-bit lane indexes.
+ */
+static uint32 dedup_perm_4[256][8];
+static uint32 dedup_perm_8[16][8];
+
+/*
+ * AVX2 dedup for 4B items, 8 items at a time. Each item is compared to the
+ * previous one (the vector rotated by one lane, with the last item of the
+ * previous vector in lane 0), and the distinct items are packed to the front
+ * and stored at the end of the output. The store may write garbage after the
+ * output, but never over input items not loaded yet.
+ */
+__attribute__((target("avx2")))
+static int
+dedup_items_avx2_4(char * data, int nitems)
+{
+    uint32         *items = (uint32 *) data;
+    const __m256i   rotate = _mm256_setr_epi32(7, 0, 1, 2, 3, 4, 5, 6);
+    const __m256i   top = _mm256_set1_epi32(7);
+    __m256i         last;
+    uint32          prev;
+    int             i = 1, n = 1;
+
+    if (nitems == 0)
+        return 0;
+
+    last = _mm256_set1_epi32((int) items[0]);
+
+    for (; i + 8 <= nitems; i += 8)
+    {
+        __m256i cur = _mm256_loadu_si256((const __m256i *) (items + i));
+        __m256i prevs = _mm256_blend_epi32(_mm256_permutevar8x32_epi32(cur, rotate), last, 0x01);
+        int     keep = ~_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(cur, prevs))) & 0xFF;
+        __m256i perm = _mm256_loadu_si256((const __m256i *) dedup_perm_4[keep]);
+
+        last = _mm256_permutevar8x32_epi32(cur, top);
+
+        _mm256_storeu_si256((__m256i *) (items + n), _mm256_permutevar8x32_epi32(cur, perm));
+        n += pg_number_of_ones[keep];
+    }
+
+    /* the store may have overwritten items[i - 1], so take it from the vector */
+    prev = (uint32) _mm256_cvtsi256_si32(last);
+
+    for (; i < nitems; i++)
+    {
+        uint32  v = items[i];
+
+        items[n] = v;
+        n += (v != prev);
+        prev = v;
+    }
+
+    return n;
+}
+
+/* AVX2 dedup for 8B items, 4 items at a time (see dedup_items_avx2_4) */
+__attribute__((target("avx2")))
+static int
+dedup_items_avx2_8(char * data, int nitems)
+{
+    uint64         *items = (uint64 *) data;
+    const __m256i   rotate = _mm256_setr_epi32(6, 7, 0, 1, 2, 3, 4, 5);
+    const __m256i   top = _mm256_setr_epi32(6, 7, 6, 7, 6, 7, 6, 7);
+    __m256i         last;
+    uint64          prev;
+    int             i = 1, n = 1;
+
+    if (nitems == 0)
+        return 0;
+
+    last = _mm256_set1_epi64x((long long) items[0]);
+
+    for (; i + 4 <= nitems; i += 4)
+    {
+        __m256i cur = _mm256_loadu_si256((const __m256i *) (items + i));
+        __m256i prevs = _mm256_blend_epi32(_mm256_permutevar8x32_epi32(cur, rotate), last, 0x03);
+        int     keep = ~_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(cur, prevs))) & 0x0F;
+        __m256i perm = _mm256_loadu_si256((const __m256i *) dedup_perm_8[keep]);
+
+        last = _mm256_permutevar8x32_epi32(cur, top);
+
+        _mm256_storeu_si256((__m256i *) (items + n), _mm256_permutevar8x32_epi32(cur, perm));
+        n += pg_number_of_ones[keep];
+    }
+
+    prev = (uint64) _mm_cvtsi128_si64(_mm256_castsi256_si128(last));
+
+    for (; i < nitems; i++)
+    {
+        uint64  v = items[i];
+
+        items[n] = v;
+        n += (v != prev);
+        prev = v;
+    }
+
+    return n;
+}
+
+#endif   /* USE_AVX2_DEDUP */
+
+#ifdef USE_NEON_DEDUP
+
+/*
+ * NEON dedup for 4B items. There's no cheap way to pack the lanes, but with
+ * few duplicates most vectors have none, and are stored as a whole. Vectors
+ * with duplicates are handled one item at a time.
+ */
+static int
+dedup_items_neon_4(char * data, int nitems)
+{
+    uint32     *items = (uint32 *) data;
+    uint32x4_t  last;
+    uint32      prev;
+    int         i = 1, n = 1;
+
+    if (nitems == 0)
+        return 0;
+
+    last = vdupq_n_u32(items[0]);
+
+    for (; i + 4 <= nitems; i += 4)
+    {
+        uint32x4_t  cur = vld1q_u32(items + i);
+        uint32x4_t  prevs = vextq_u32(last, cur, 3);
+
+        if (vmaxvq_u32(vceqq_u32(cur, prevs)) == 0)
+        {
+            vst1q_u32(items + n, cur);
+            n += 4;
+        }
+        else
+        {
+            uint32  v[4];
+            int     k;
+
+            vst1q_u32(v, cur);
+            prev = vgetq_lane_u32(last, 3);
+
+            for (k = 0; k < 4; k++)
+            {
+                items[n] = v[k];
+                n += (v[k] != prev);
+                prev = v[k];
+            }
+        }
+
+        last = cur;
+    }
+
+    prev = vgetq_lane_u32(last, 3);
+
+    for (; i < nitems; i++)
+    {
+        uint32  v = items[i];
+
+        items[n] = v;
+        n += (v != prev);
+        prev = v;
+    }
+
+    return n;
+}
+
+/* NEON dedup for 8B items, 2 items at a time (see dedup_items_neon_4) */
+static int
+dedup_items_neon_8(char * data, int nitems)
+{
+    uint64     *items = (uint64 *) data;
+    uint64x2_t  last;
+    uint64      prev;
+    int         i = 1, n = 1;
+
+    if (nitems == 0)
+        return 0;
+
+    last = vdupq_n_u64(items[0]);
+
+    for (; i + 2 <= nitems; i += 2)
+    {
+        uint64x2_t  cur = vld1q_u64(items + i);
+        uint64x2_t  prevs = vextq_u64(last, cur, 1);
+
+        if (vmaxvq_u32(vreinterpretq_u32_u64(vceqq_u64(cur, prevs))) == 0)
+        {
+            vst1q_u64(items + n, cur);
+            n += 2;
+        }
+        else
+        {
+            uint64  v0 = vgetq_lane_u64(cur, 0);
+            uint64  v1 = vgetq_lane_u64(cur, 1);
+
+            prev = vgetq_lane_u64(last, 1);
+
+            items[n] = v0;
+            n += (v0 != prev);
+            items[n] = v1;
+            n += (v1 != v0);
+        }
+
+        last = cur;
+    }
+
+    prev = vgetq_lane_u64(last, 1);
+
+    for (; i < nitems; i++)
+    {
+        uint64  v = items[i];
+
+        items[n] = v;
+        n += (v != prev);
+        prev = v;
+    }
+
+    return n;
+}
+
+#endif   /* USE_NEON_DEDUP */
+
+/* pick the SIMD dedup kernels supported by the CPU (called from _PG_init) */
+static void
+choose_dedup_kernels(void)
+{
+#if defined(USE_AVX2_DEDUP)
+    if (__builtin_cpu_supports("avx2"))
+    {
+        int     mask, lane, k;
+
+        for (mask = 0; mask < 256; mask++)
+        {
+            for (lane = 0, k = 0; lane < 8; lane++)
+                if (mask & (1 << lane))
+                    dedup_perm_4[mask][k++] = lane;
+        }
+
+        for (mask = 0; mask < 16; mask++)
+        {
+            for (lane = 0, k = 0; lane < 4; lane++)
+            {
+                if (mask & (1 << lane))
+                {
+                    dedup_perm_8[mask][k++] = 2 * lane;
+                    dedup_perm_8[mask][k++] = 2 * lane + 1;
+                }
+            }
+        }
+
+        dedup_kernel_4 = dedup_items_avx2_4;
+        dedup_kernel_8 = dedup_items_avx2_8;
+    }
+#elif defined(USE_NEON_DEDUP)
+    dedup_kernel_4 = dedup_items_neon_4;
+    dedup_kernel_8 = dedup_items_neon_8;
+#endif
+}
+
+/* item of 1/2/4/8B as an unsigned integer (the order of compare_values) */
+static inline uint64
+load_item(const char * item, int item_size)
+{
+    switch (item_size)
+    {
+        case 1:
+            return *(uint8 *) item;
+        case 2:
+        {
+            uint16  v;
+            memcpy(&v, item, sizeof(uint16));
+            return v;
+        }
+        case 4:
+        {
+            uint32  v;
+            memcpy(&v, item, sizeof(uint32));
+            return v;
+        }
+        default:
+        {
+            uint64  v;
+            Assert(item_size == sizeof(uint64));
+            memcpy(&v, item, sizeof(uint64));
+            return v;
+        }
+    }
+}
+
+static inline void
+store_item(char * item, int item_size, uint64 value)
+{
+    switch (item_size)
+    {
+        case 1:
+            *(uint8 *) item = (uint8) value;
+            break;
+        case 2:
+        {
+            uint16  v = (uint16) value;
+            memcpy(item, &v, sizeof(uint16));
+            break;
+        }
+        case 4:
+        {
+            uint32  v = (uint32) value;
+            memcpy(item, &v, sizeof(uint32));
+            break;
+        }
+        default:
+            Assert(item_size == sizeof(uint64));
+            memcpy(item, &value, sizeof(uint64));
+    }
+}
+
+/* unsigned integer of nbytes in the little-endian (serialized) order */
+static inline uint64
+load_le(const char * ptr, int nbytes)
+{
+    uint64  value = 0;
+    int     i;
+
+    for (i = nbytes - 1; i >= 0; i--)
+        value = (value << 8) | (uint8) ptr[i];
+
+    return value;
+}
+
+static inline void
+store_le(char * ptr, int nbytes, uint64 value)
+{
+    int     i;
+
+    for (i = 0; i < nbytes; i++)
+    {
+        ptr[i] = (char) (value & 0xFF);
+        value >>= 8;
+    }
+}
+
+/* LEB128 - 7 bits per byte, high bit set on all bytes but the last one */
+static inline int
+varint_size(uint64 value)
+{
+    int     len = 1;
+
+    while (value >= 0x80)
+    {
+        value >>= 7;
+        len++;
+    }
+
+    return len;
+}
+
+static inline char *
+varint_put(char * ptr, uint64 value)
+{
+    while (value >= 0x80)
+    {
+        *ptr++ = (char) ((value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+
+    *ptr++ = (char) value;
+
+    return ptr;
+}
+
+static inline const char *
+varint_get(const char * ptr, const char * end, uint64 * value)
+{
+    uint64  result = 0;
+    int     shift = 0;
+
+    while (true)
+    {
+        uint8   byte;
+
+        if ((ptr >= end) || (shift > 63))
+            elog(ERROR, "invalid lrtm_count_distinct state (corrupted varint)");
+
+        byte = (uint8) *ptr++;
+        result |= (uint64) (byte & 0x7F) << shift;
+
+        if (! (byte & 0x80))
+            break;
+
+        shift += 7;
+    }
+
+    *value = result;
+
+    return ptr;
+}
+
+/*
+ * Size of the delta encoding of sorted distinct items, or the raw size when
+ * the width can't be delta-encoded (so it never gets picked).
+ */
+static Size
+delta_encoded_size(const char * data, uint32 nitems, int item_size)
+{
+    Size    len = 0;
+    uint64  prev = 0;
+    uint32  i;
+
+    if ((item_size != 1) && (item_size != 2) && (item_size != 4) && (item_size != 8))
+        return (Size) nitems * item_size;
+
+    for (i = 0; i < nitems; i++)
+    {
+        uint64  value = load_item(data + (Size) i * item_size, item_size);
+
+        len += varint_size((i == 0) ? value : (value - prev - 1));
+        prev = value;
+    }
+
+    return len;
+}
+
+static char *
+delta_encode(const char * data, uint32 nitems, int item_size, char * out)
+{
+    uint64  prev = 0;
+    uint32  i;
+
+    for (i = 0; i < nitems; i++)
+    {
+        uint64  value = load_item(data + (Size) i * item_size, item_size);
+
+        Assert((i == 0) || (value > prev));
+
+        out = varint_put(out, (i == 0) ? value : (value - prev - 1));
+        prev = value;
+    }
+
+    return out;
+}
+
+static void
+delta_decode(const char * in, Size len, uint32 nitems, int item_size, char * out)
+{
+    const char *end = in + len;
+    uint64      value = 0;
+    uint32      i;
+
+    for (i = 0; i < nitems; i++)
+    {
+        uint64  delta;
+
+        in = varint_get(in, end, &delta);
+        value = (i == 0) ? delta : (value + delta + 1);
+
+        store_item(out + (Size) i * item_size, item_size, value);
+    }
+
+    if (in != end)
+        elog(ERROR, "invalid lrtm_count_distinct state (trailing data)");
+}
+
+/*
+ * Make a private copy of the read-only (deserialized) data, in the aggregate
+ * context, decoding it if needed.
+ */
+static void
+set_materialize(element_set_t * eset)
+{
+    char   *data;
+
+    Assert(eset->readonly);
+
+    if (eset->encoding == SET_ENCODING_DELTA)
+    {
+        Size    nbytes = (Size) eset->nall * eset->item_size;
+
+        if (nbytes <= SET_INLINE_BYTES)
+            data = (char *) eset->inline_data;
+        else
+            data = MemoryContextAlloc(eset->aggctx, nbytes);
+
+        delta_decode(eset->data, eset->nbytes, eset->nall, eset->item_size, data);
+
+        eset->nbytes = nbytes;
+    }
+    else
+    {
+        if (eset->nbytes <= SET_INLINE_BYTES)
+            data = (char *) eset->inline_data;
+        else
+            data = MemoryContextAlloc(eset->aggctx, eset->nbytes);
+
+        memcpy(data, eset->data, eset->nbytes);
+    }
+
+    eset->data = data;
+    eset->readonly = false;
+    eset->encoding = SET_ENCODING_RAW;
+}
+
+/* start reading a compacted (or read-only) set in array mode */
+static void
+reader_init(run_reader_t * reader, element_set_t * eset)
+{
+    Assert(eset->mode == SET_MODE_ARRAY);
+    Assert(eset->nall == eset->nsorted);
+
+    if (eset->readonly)
+        reader_init_run(reader, eset->data, eset->nbytes, eset->nall,
+                        eset->item_size, eset->encoding);
+    else
+        reader_init_run(reader, eset->data, (Size) eset->nall * eset->item_size,
+                        eset->nall, eset->item_size, SET_ENCODING_RAW);
+}
+
+static void
+reader_init_run(run_reader_t * reader, const char * data, Size nbytes,
+                uint32 nitems, int item_size, uint8 encoding)
+{
+    reader->ptr = data;
+    reader->end = data + nbytes;
+    reader->remaining = nitems;
+    reader->item_size = item_size;
+    reader->encoding = encoding;
+    reader->value = 0;
+    reader->item = NULL;
+    reader->file = NULL;
+    reader->chunk = NULL;
+}
+
+static inline bool
+reader_next(run_reader_t * reader)
+{
+    uint64  delta;
+
+    if (reader->remaining == 0)
+        return false;
+
+    if (reader->encoding == SET_ENCODING_RAW)
+    {
+        /* spilled runs are read in chunks */
+        if (reader->ptr == reader->end)
+            reader_fill(reader);
+
+        reader->item = reader->ptr;
+        reader->ptr += reader->item_size;
+        reader->remaining--;
+
+        return true;
+    }
+
+    reader->ptr = varint_get(reader->ptr, reader->end, &delta);
+    reader->value = (reader->item == NULL) ? delta : (reader->value + delta + 1);
+
+    store_item(reader->buffer, reader->item_size, reader->value);
+
+    reader->item = reader->buffer;
+    reader->remaining--;
+
+    return true;
+}
+
+/* keep a private copy of the sorted run of a compacted (or read-only) set */
+static void
+set_add_run(element_set_t * eset, element_set_t * src)
+{
+    set_run_t  *run;
+
+    Assert(src->mode == SET_MODE_ARRAY);
+    Assert(src->nall == src->nsorted);
+    Assert(src->nruns == 0);
+
+    if (eset->nruns == eset->maxruns)
+    {
+        eset->maxruns = Max(4, eset->maxruns * 2);
+
+        if (eset->runs == NULL)
+            eset->runs = MemoryContextAlloc(eset->aggctx, eset->maxruns * sizeof(set_run_t));
+        else
+            eset->runs = repalloc(eset->runs, eset->maxruns * sizeof(set_run_t));
+    }
+
+    run = &eset->runs[eset->nruns++];
+
+    run->nitems = src->nall;
+    run->encoding = src->readonly ? src->encoding : SET_ENCODING_RAW;
+    run->nbytes = src->readonly ? src->nbytes : (Size) src->nall * src->item_size;
+    run->data = MemoryContextAlloc(eset->aggctx, run->nbytes);
+
+    memcpy(run->data, src->data, run->nbytes);
+
+    eset->runs_bytes += run->nbytes;
+}
+
+/* is the current item of reader a smaller than the one of reader b? */
+static inline bool
+reader_less(run_reader_t * a, run_reader_t * b)
+{
+    return compare_values(a->item, b->item, a->item_size) < 0;
+}
+
+/*
+ * Merge sorted runs of distinct items using a binary heap of run readers, so
+ * that each item is looked at just once and the cost is O(total * log(k)).
+ * Items may repeat across the runs, and only the first copy is kept. With
+ * output NULL the items are only counted, and nothing gets written (or they
+ * are appended to the spill file, as a new run).
+ */
+static Size
+kway_merge(run_reader_t * readers, int nruns, int item_size, char * output,
+           set_spill_t * spill)
+{
+    int             nreaders = 0;
+    run_reader_t  **heap;
+    char           *last;
+    Size            count = 0;
+    int             i;
+
+    heap = palloc(nruns * sizeof(run_reader_t *));
+
+    /* when only counting, remember the last item (readers may reuse it) */
+    last = (output == NULL) ? palloc(item_size) : NULL;
+
+    for (i = 0; i < nruns; i++)
+    {
+        int     j;
+
+        /* skip empty runs */
+        if (! reader_next(&readers[i]))
+            continue;
+
+        /* sift up */
+        j = nreaders++;
+        while ((j > 0) && reader_less(&readers[i], heap[(j - 1) / 2]))
+        {
+            heap[j] = heap[(j - 1) / 2];
+            j = (j - 1) / 2;
+        }
+        heap[j] = &readers[i];
+    }
+
+    while (nreaders > 0)
+    {
+        run_reader_t   *top = heap[0];
+        int             j = 0;
+
+        if (output != NULL)
+        {
+            if ((count == 0) ||
+                (compare_values(output + (count - 1) * item_size, top->item, item_size) != 0))
+                memcpy(output + (count++) * item_size, top->item, item_size);
+        }
+        else if ((count == 0) || (compare_values(last, top->item, item_size) != 0))
+        {
+            memcpy(last, top->item, item_size);
+            count++;
+
+            if (spill != NULL)
+                spill_append(spill, top->item, item_size);
+        }
+
+        /*
+         * Advance the top reader, or replace it by the last one. With many
+         * runs the hardware prefetcher may not track all the streams, so
+         * request the data a bit ahead of the reader.
+         */
+        if (! reader_next(top))
+            top = heap[--nreaders];
+        else if ((top->file == NULL) && (top->end - top->ptr > PREFETCH_DISTANCE))
+            PREFETCH_READ(top->ptr + PREFETCH_DISTANCE);
+
+        /* sift down */
+        while (true)
+        {
+            int     child = 2 * j + 1;
+
+            if (child >= nreaders)
+                break;
+
+            if ((child + 1 < nreaders) && reader_less(heap[child + 1], heap[child]))
+                child++;
+
+            if (! reader_less(heap[child], top))
+                break;
+
+            heap[j] = heap[child];
+            j = child;
+        }
+
+        if (nreaders > 0)
+            heap[j] = top;
+    }
+
+    pfree(heap);
+
+    if (last != NULL)
+        pfree(last);
+
+    return count;
+}
+
+/*
+ * Branchless merge of two sorted runs of distinct 4/8B items, with the items
+ * present in both runs written once. Returns the number of output items.
+ */
+#define DEFINE_MERGE_FORWARD(width, type) \
+static Size \
+merge_forward_##width(const char * run_a, Size na, const char * run_b, Size nb, \
+                      char * output) \
+{ \
+    const type *a = (const type *) run_a; \
+    const type *b = (const type *) run_b; \
+    type       *o = (type *) output; \
+    Size        i = 0, j = 0, n = 0; \
+ \
+    while ((i < na) && (j < nb)) \
+    { \
+        type    x = a[i]; \
+        type    y = b[j]; \
+ \
+        o[n++] = (x < y) ? x : y; \
+        i += (x <= y); \
+        j += (y <= x); \
+    } \
+ \
+    memcpy(o + n, a + i, (na - i) * sizeof(type)); \
+    n += (na - i); \
+ \
+    memcpy(o + n, b + j, (nb - j) * sizeof(type)); \
+    n += (nb - j); \
+ \
+    return n; \
+}
+
+DEFINE_MERGE_FORWARD(4, uint32)
+DEFINE_MERGE_FORWARD(8, uint64)
+
+/*
+ * Merge the sorted (compacted) data with all the runs collected by combine,
+ * so that each item is moved just once. The output is a single allocation.
+ */
+static void
+merge_runs(element_set_t * eset)
+{
+    int             item_size = eset->item_size;
+    run_reader_t   *readers;
+    Size            nitems = eset->nall;
+    char           *data;
+    uint32          i;
+
+    Assert(eset->mode == SET_MODE_ARRAY);
+    Assert(eset->nall == eset->nsorted);
+    Assert(! eset->readonly);
+
+    for (i = 0; i < eset->nruns; i++)
+        nitems += eset->runs[i].nitems;
+
+    readers = palloc((eset->nruns + 1) * sizeof(run_reader_t));
+
+    /* the set itself, then the runs */
+    reader_init(&readers[0], eset);
+    for (i = 0; i < eset->nruns; i++)
+        reader_init_run(&readers[i + 1], eset->runs[i].data, eset->runs[i].nbytes,
+                        eset->runs[i].nitems, item_size, eset->runs[i].encoding);
+
+    data = MemoryContextAlloc(eset->aggctx, nitems * item_size);
+
+    /* a single raw run (combine of two states) needs no heap */
+    if ((eset->nruns == 1) && (eset->runs[0].encoding == SET_ENCODING_RAW) &&
+        ((item_size == 4) || (item_size == 8)))
+        nitems = (item_size == 4)
+            ? merge_forward_4(eset->data, eset->nall, eset->runs[0].data, eset->runs[0].nitems, data)
+            : merge_forward_8(eset->data, eset->nall, eset->runs[0].data, eset->runs[0].nitems, data);
+    else
+        nitems = kway_merge(readers, eset->nruns + 1, item_size, data, NULL);
+
+    pfree(readers);
+
+    for (i = 0; i < eset->nruns; i++)
+        pfree(eset->runs[i].data);
+
+    set_free_data(eset);
+
+    eset->data = data;
+    eset->nbytes = nitems * item_size;
+    eset->nall = eset->nsorted = nitems;
+
+    eset->nruns = 0;
+    eset->runs_bytes = 0;
+}
+
+/*
+ * Number of distinct items, without building the merged array. The tail gets
+ * sorted in place, and then the sorted parts and runs are only counted by the
+ * merge. The state remains valid (and may even be compacted later).
+ */
+static int64
+count_distinct(element_set_t * eset)
+{
+    int             item_size = eset->item_size;
+    run_reader_t   *readers;
+    int             nreaders = 0;
+    int64           count;
+    uint32          i;
+
+    if (eset->mode == SET_MODE_SKETCH)
+        return set_count(eset);
+
+    /* a single run of distinct items (deserialized, a hash table or a bitmap) */
+    if (eset->nruns == 0)
+    {
+        if (eset->readonly || (eset->mode == SET_MODE_HASH) ||
+            (eset->mode == SET_MODE_BITMAP))
+            return eset->nall;
+    }
+
+    if (eset->readonly)
+        set_materialize(eset);
+
+    sort_tail(eset);
+
+    if ((eset->nruns == 0) && (eset->nall == eset->nsorted) && (eset->spill == NULL))
+        return eset->nall;
+
+    readers = palloc((eset->nruns + 2 + (eset->spill ? eset->spill->nruns : 0)) *
+                     sizeof(run_reader_t));
+
+    /* sorted prefix, sorted tail, and then the runs */
+    reader_init_run(&readers[nreaders++], eset->data, (Size) eset->nsorted * item_size,
+                    eset->nsorted, item_size, SET_ENCODING_RAW);
+
+    if (eset->nall > eset->nsorted)
+        reader_init_run(&readers[nreaders++], eset->data + (Size) eset->nsorted * item_size,
+                        (Size) (eset->nall - eset->nsorted) * item_size,
+                        eset->nall - eset->nsorted, item_size, SET_ENCODING_RAW);
+
+    for (i = 0; i < eset->nruns; i++)
+        reader_init_run(&readers[nreaders++], eset->runs[i].data, eset->runs[i].nbytes,
+                        eset->runs[i].nitems, item_size, eset->runs[i].encoding);
+
+    /* the spilled runs are streamed from the file */
+    if (eset->spill != NULL)
+        nreaders = spill_init_readers(eset, readers, nreaders);
+
+    count = kway_merge(readers, nreaders, item_size, NULL, NULL);
+
+    for (i = 0; i < nreaders; i++)
+    {
+        if (readers[i].chunk != NULL)
+            pfree(readers[i].chunk);
+    }
+
+    pfree(readers);
+
+    return count;
+}
+
+/* the per-call cache in fn_extra (allocated on the first call) */
+static fn_cache_t *
+get_fn_cache(FunctionCallInfo fcinfo)
+{
+    if (fcinfo->flinfo->fn_extra == NULL)
+        fcinfo->flinfo->fn_extra = MemoryContextAllocZero(fcinfo->flinfo->fn_mcxt,
+                                                          sizeof(fn_cache_t));
+
+    return (fn_cache_t *) fcinfo->flinfo->fn_extra;
+}
+
+/*
+ * Type of the values passed as the second argument (an element of the array
+ * for is_array), resolved only on the first call.
+ */
+static Oid
+get_element_type_cached(FunctionCallInfo fcinfo, bool is_array)
+{
+    fn_cache_t *cache = get_fn_cache(fcinfo);
+
+    if (! OidIsValid(cache->element_type))
+    {
+        Oid     input_type = get_fn_expr_argtype(fcinfo->flinfo, 1);
+
+        cache->element_type = is_array ? get_element_type(input_type) : input_type;
+    }
+
+    return cache->element_type;
+}
+
+/* value type (see lookup_value_type) of the second argument, resolved once */
+static value_type_t *
+get_value_type_cached(FunctionCallInfo fcinfo, bool is_array)
+{
+    fn_cache_t *cache = get_fn_cache(fcinfo);
+
+    if (! cache->has_vtype)
+    {
+        lookup_value_type(get_element_type_cached(fcinfo, is_array),
+                          PG_GET_COLLATION(), &cache->vtype);
+        cache->has_vtype = true;
+    }
+
+    return &cache->vtype;
+}
+
+/*
+ * Value type of the second argument, for aggregates that only hash the
+ * values (lrtm_count_distinct_approx). Unlike get_value_type_cached this
+ * accepts types the sets can't store, and hashes their datum bytes.
+ */
+static value_type_t *
+get_hash_type_cached(FunctionCallInfo fcinfo)
+{
+    fn_cache_t *cache = get_fn_cache(fcinfo);
+
+    if (! cache->has_vtype)
+    {
+        (void) try_lookup_value_type(get_element_type_cached(fcinfo, false),
+                                     PG_GET_COLLATION(), &cache->vtype);
+        cache->has_vtype = true;
+    }
+
+    return &cache->vtype;
+}
+
+/*
+ * Value type of the composite keys built from all the arguments but the
+ * first one, resolved once. The key is a fixed-length item with the items of
+ * the columns concatenated (see value_to_item), so e.g. a pair of int4 is an
+ * 8B item, and can use the hash table and the radix sort. The items of the
+ * columns are keys in their own right, so the keys are equal exactly when
+ * all the columns are (varlena columns are fingerprints, like for single
+ * values), but the key order is not the order of the rows.
+ */
+static value_type_t *
+get_key_type_cached(FunctionCallInfo fcinfo)
+{
+    fn_cache_t *cache = get_fn_cache(fcinfo);
+    Size        width = 0;
+    int         i;
+
+    if (cache->has_vtype)
+        return &cache->vtype;
+
+    cache->ncolumns = PG_NARGS() - 1;
+    cache->columns = MemoryContextAlloc(fcinfo->flinfo->fn_mcxt,
+                                        cache->ncolumns * sizeof(value_type_t));
+
+    for (i = 0; i < cache->ncolumns; i++)
+    {
+        Oid     column_type = get_fn_expr_argtype(fcinfo->flinfo, i + 1);
+
+        if (! OidIsValid(column_type))
+            elog(ERROR, "could not determine the type of column %d", i + 1);
+
+        lookup_value_type(column_type, PG_GET_COLLATION(), &cache->columns[i]);
+        width += value_item_size(&cache->columns[i]);
+    }
+
+    if (width > PG_INT16_MAX)
+        elog(ERROR, "composite key too long (%zu bytes)", width);
+
+    cache->key = MemoryContextAlloc(fcinfo->flinfo->fn_mcxt, width);
+
+    cache->vtype.kind = VALUE_BYREF;
+    cache->vtype.order = VALUE_ORDER_UNSIGNED;
+    cache->vtype.typlen = (int16) width;
+    cache->vtype.typbyval = false;
+    cache->vtype.typalign = 'c';
+    cache->vtype.typid = RECORDOID;
+    cache->vtype.hash_proc = NULL;
+    cache->vtype.collation = PG_GET_COLLATION();
+    cache->has_vtype = true;
+
+    return &cache->vtype;
+}
+
+/*
+ * Arena for set headers allocated in the aggregate context ctx. The arenas
+ * are in the fn_extra cache, so they are shared by all groups of the aggregate.
+ * Returns NULL if all the arenas are used by other contexts.
+ */
+static set_arena_t *
+get_set_arena(FunctionCallInfo fcinfo, MemoryContext ctx)
+{
+    fn_cache_t     *cache = get_fn_cache(fcinfo);
+    set_arena_t    *arena = NULL;
+    arena_reset_t  *reset;
+    int             i;
+
+    for (i = 0; i < ARENA_MAX_CONTEXTS; i++)
+    {
+        if (cache->arenas[i].ctx == ctx)
+            return &cache->arenas[i];
+
+        if ((arena == NULL) && (cache->arenas[i].ctx == NULL))
+            arena = &cache->arenas[i];
+    }
+
+    if (arena == NULL)
+        return NULL;
+
+    /* start using a free arena, and forget about it when ctx gets reset */
+    reset = MemoryContextAlloc(ctx, sizeof(arena_reset_t));
+    reset->arena = arena;
+    reset->ctx = ctx;
+    reset->callback.func = set_arena_reset;
+    reset->callback.arg = reset;
+
+    MemoryContextRegisterResetCallback(ctx, &reset->callback);
+
+    arena->ctx = ctx;
+    arena->ptr = NULL;
+    arena->avail = 0;
+    arena->block_size = ARENA_MIN_BLOCK;
+
+    return arena;
+}
+
+static void
+set_arena_reset(void * arg)
+{
+    arena_reset_t  *reset = (arena_reset_t *) arg;
+
+    /* the blocks were freed with the context */
+    if (reset->arena->ctx == reset->ctx)
+        memset(reset->arena, 0, sizeof(set_arena_t));
+}
+
+/* allocate a chunk from the arena (or from the current context without one) */
+static void *
+set_arena_alloc(set_arena_t * arena, Size size)
+{
+    char   *ptr;
+
+    if (arena == NULL)
+        return palloc(size);
+
+    size = MAXALIGN(size);
+
+    if (arena->avail < size)
+    {
+        Size    block_size = Max(arena->block_size, size);
+
+        arena->ptr = MemoryContextAlloc(arena->ctx, block_size);
+        arena->avail = block_size;
+        arena->block_size = Min(arena->block_size * 2, ARENA_MAX_BLOCK);
+    }
+
+    ptr = arena->ptr;
+    arena->ptr += size;
+    arena->avail -= size;
+
+    return ptr;
+}
+
+/* resize the data array (moving it out of the header, if needed) */
+static void
+set_resize_data(element_set_t * eset, Size nbytes)
+{
+    Assert(! eset->readonly);
+
+    if (SET_DATA_INLINE(eset))
+    {
+        char   *data = MemoryContextAlloc(eset->aggctx, nbytes);
+
+        memcpy(data, eset->data, Min(nbytes, eset->nbytes));
+        eset->data = data;
+    }
+    else
+        eset->data = repalloc(eset->data, nbytes);
+
+    eset->nbytes = nbytes;
+}
+
+/*
+ * Replace the data array with a new one, built while the old one was still
+ * needed. Small ones (built in a local buffer) get moved to the header.
+ */
+static void
+set_replace_data(element_set_t * eset, char * data, Size nbytes)
+{
+    set_free_data(eset);
+
+    if (nbytes <= SET_INLINE_BYTES)
+    {
+        memcpy(eset->inline_data, data, nbytes);
+        data = (char *) eset->inline_data;
+    }
+
+    eset->data = data;
+    eset->nbytes = nbytes;
+}
+
+/* free the data array (unless it's inline, or points to serialized data) */
+static void
+set_free_data(element_set_t * eset)
+{
+    if (! (SET_DATA_INLINE(eset) || eset->readonly))
+        pfree(eset->data);
+}
+
+/*
+ * Order-preserving key of a by-value item of the given width (see
+ * VALUE_ORDER_SIGNED). The value is passed as its bits, zero-extended.
+ */
+static inline uint64
+value_to_key(uint8 order, int width, uint64 value)
+{
+    uint64  sign = UINT64CONST(1) << (8 * width - 1);
+    uint64  mask = ITEM_MASK(width);
+
+    switch (order)
+    {
+        case VALUE_ORDER_SIGNED:
+            return value ^ sign;
+
+        case VALUE_ORDER_FLOAT:
+        {
+            /* exponent bits (and canonical NaN) of float4 / float8 */
+            uint64  expbits = (width == 4) ? 0x7F800000 : UINT64CONST(0x7FF0000000000000);
+            uint64  nan = (width == 4) ? 0x7FC00000 : UINT64CONST(0x7FF8000000000000);
+
+            /* -0.0 is the same as 0.0, and all NaNs are equal */
+            if ((value & ~sign) == 0)
+                value = 0;
+            else if (((value & expbits) == expbits) && ((value & ~(sign | expbits)) != 0))
+                value = nan;
+
+            return (value & sign) ? (~value & mask) : (value | sign);
+        }
+    }
+
+    return value;
+}
+
+/* inverse of value_to_key */
+static inline uint64
+key_to_value(uint8 order, int width, uint64 key)
+{
+    uint64  sign = UINT64CONST(1) << (8 * width - 1);
+
+    switch (order)
+    {
+        case VALUE_ORDER_SIGNED:
+            return key ^ sign;
+
+        case VALUE_ORDER_FLOAT:
+            return (key & sign) ? (key ^ sign) : (~key & ITEM_MASK(width));
+    }
+
+    return key;
+}
+
+/* turn values of the given width into keys, in place */
+static void
+keys_from_values(uint8 order, int width, char * items, Size nitems)
+{
+    Size    i;
+
+    if (order == VALUE_ORDER_UNSIGNED)
+        return;
+
+    for (i = 0; i < nitems; i++)
+    {
+        char   *item = items + i * width;
+
+        store_item(item, width, value_to_key(order, width, load_item(item, width)));
+    }
+}
+
+/*
+ * Add the second (non-NULL) set into the first one, which may be NULL, and
+ * return the result. The second set may be read-only (deserialized).
+ */
+static element_set_t *
+combine_sets(FunctionCallInfo fcinfo, MemoryContext agg_context,
+             element_set_t * eset1, element_set_t * eset2)
+{
+    int i;
+    MemoryContext old_context;
+
+    if (eset1 == NULL)
+    {
+        old_context = MemoryContextSwitchTo(agg_context);
+
+        /* copy the whole header, the state may be in either mode */
+        eset1 = (element_set_t *) set_arena_alloc(get_set_arena(fcinfo, agg_context),
+                                                  sizeof(element_set_t));
+        memcpy(eset1, eset2, sizeof(element_set_t));
+        eset1->aggctx = agg_context;
+
+        /* a read-only state gets copied (and decoded) right away */
+        if (eset1->readonly)
+            set_materialize(eset1);
+        else
+        {
+            /* merge the runs of the other state first, we don't copy them */
+            compact_set(eset2, false);
+            memcpy(eset1, eset2, sizeof(element_set_t));
+            eset1->aggctx = agg_context;
+
+            /* the (empty) runs array and scratch belong to the other state */
+            eset1->runs = NULL;
+            eset1->maxruns = 0;
+            eset1->scratch = NULL;
+            eset1->scratch_bytes = 0;
+
+            if (eset1->nbytes <= SET_INLINE_BYTES)
+                eset1->data = (char *) eset1->inline_data;
+            else
+                eset1->data = palloc(eset1->nbytes);
+
+            memcpy(eset1->data, eset2->data, eset1->nbytes);
+        }
+
+        /* deserialized states have no stats, but the combined one may */
+        if ((eset1->stats == NULL) && (track_stats || log_stats))
+        {
+            eset1->stats = palloc0(sizeof(set_stats_t));
+            backend_stats.sets++;
+        }
+
+        MemoryContextSwitchTo(old_context);
+
+        return eset1;
+    }
+
+    Assert((eset1 != NULL) && (eset2 != NULL));
+    Assert(eset1->item_size > 0);
+
+    check_same_type(eset1, eset2);
+
+    /* once either side is a sketch, the result is a sketch too */
+    if ((eset1->mode == SET_MODE_SKETCH) || (eset2->mode == SET_MODE_SKETCH))
+    {
+        old_context = MemoryContextSwitchTo(agg_context);
+
+        set_to_sketch(eset1);
+        set_to_sketch(eset2);
+
+        MemoryContextSwitchTo(old_context);
+
+        for (i = 0; i < eset1->nbytes; i++)
+            eset1->data[i] = Max((uint8) eset1->data[i], (uint8) eset2->data[i]);
+
+        return eset1;
+    }
+
+    /*
+     * A bitmap gets the other bitmap ORed into it, or the items of the other
+     * set added, as long as the keys are not too far from its range. Then
+     * it becomes an array (the items added so far are just duplicates).
+     */
+    if ((eset1->mode == SET_MODE_BITMAP) && (eset2->spill == NULL))
+    {
+        bool    added;
+
+        old_context = MemoryContextSwitchTo(agg_context);
+        added = bitmap_add_set(eset1, eset2);
+        MemoryContextSwitchTo(old_context);
+
+        if (added)
+            return eset1;
+    }
+
+    if (eset1->mode == SET_MODE_BITMAP)
+        bitmap_to_array(eset1);
+
+    /*
+     * Just keep a copy of the second state's sorted run (still encoded, if it
+     * was deserialized), all the runs get merged at once by compact_set.
+     */
+    old_context = MemoryContextSwitchTo(agg_context);
+
+    /* a spilled (not serialized) state gets merged into our file */
+    if (eset2->spill != NULL)
+        spill_absorb(eset1, eset2);
+    else
+    {
+        if (! eset2->readonly)
+            compact_set(eset2, false);
+
+        if (eset2->mode == SET_MODE_BITMAP)
+            bitmap_to_array(eset2);
+
+        set_add_run(eset1, eset2);
+
+        SET_STATS_ADD(eset1, combine_bytes, eset1->runs[eset1->nruns - 1].nbytes);
+    }
+
+    MemoryContextSwitchTo(old_context);
+
+    /* the merged set may be over the memory limit */
+    if ((eset1->max_bytes > 0) && (eset1->nbytes + eset1->runs_bytes > eset1->max_bytes))
+    {
+        compact_set(eset1, false);
+
+        if (eset1->nbytes > eset1->max_bytes)
+            set_to_sketch(eset1);
+    }
+    else if ((eset1->max_bytes == 0) && (spill_limit() > 0) &&
+             (eset1->nbytes + eset1->runs_bytes > spill_limit()))
+    {
+        /* the merge still needs the memory, but only for a moment */
+        compact_set(eset1, false);
+
+        if (eset1->mode == SET_MODE_ARRAY)
+            set_spill(eset1);
+    }
+
+    return eset1;
+}
+
+/*
+ * The serialized header (version 2): version, mode, encoding and kind bytes,
+ * item_size (2B), typalign and order bytes, nitems, max_bytes and typid (4B
+ * each).
+ */
+static void
+set_header_write(const set_header_t * header, char * out)
+{
+    out[0] = (char) header->version;
+    out[1] = (char) header->mode;
+    out[2] = (char) header->encoding;
+    out[3] = (char) header->kind;
+    store_le(out + 4, 2, header->item_size);
+    out[6] = header->typalign;
+    out[7] = (char) header->order;
+    store_le(out + 8, 4, header->nitems);
+    store_le(out + 12, 4, header->max_bytes);
+    store_le(out + 16, 4, header->typid);
+}
+
+/* returns the length of the header (depends on the version) */
+static int
+set_header_read(const char * in, set_header_t * header)
+{
+    StaticAssertStmt(offsetof(set_header_t, typid) == SET_HEADER_V1_BYTES,
+                     "version 1 states are the native set_header_t, without typid");
+
+    /* the old states are the struct, as written by this machine */
+    if ((uint8) in[0] == 1)
+    {
+        memcpy(header, in, SET_HEADER_V1_BYTES);
+        header->typid = InvalidOid;
+        return SET_HEADER_V1_BYTES;
+    }
+
+    header->version = (uint8) in[0];
+    header->mode = (uint8) in[1];
+    header->encoding = (uint8) in[2];
+    header->kind = (uint8) in[3];
+    header->item_size = (uint16) load_le(in + 4, 2);
+    header->typalign = in[6];
+    header->order = (uint8) in[7];
+    header->nitems = (uint32) load_le(in + 8, 4);
+    header->max_bytes = (uint32) load_le(in + 12, 4);
+    header->typid = (Oid) load_le(in + 16, 4);
+
+    return SET_HEADER_BYTES;
+}
+
+#ifdef WORDS_BIGENDIAN
+/* swap the bytes of 2/4/8B items, between the native and serialized order */
+static void
+swap_items(char * items, Size nitems, int item_size)
+{
+    Size    i;
+
+    for (i = 0; i < nitems; i++)
+    {
+        char   *item = items + i * item_size;
+
+        switch (item_size)
+        {
+            case 2:
+                store_item(item, 2, pg_bswap16((uint16) load_item(item, 2)));
+                break;
+            case 4:
+                store_item(item, 4, pg_bswap32((uint32) load_item(item, 4)));
+                break;
+            case 8:
+                store_item(item, 8, pg_bswap64(load_item(item, 8)));
+                break;
+        }
+    }
+}
+
+/*
+ * Items to serialize. The serialized by-reference 2/4/8B items are ordered
+ * (and delta-encoded) as little-endian integers, but the sort kernels order
+ * them by the native ones - so use a copy with the bytes swapped and sorted
+ * again. Swapping the raw items again restores the original bytes.
+ */
+static char *
+set_portable_items(element_set_t * eset)
+{
+    int     item_size = eset->item_size;
+    char   *items;
+
+    if ((eset->vtype.kind != VALUE_BYREF) ||
+        ((item_size != 2) && (item_size != 4) && (item_size != 8)))
+        return eset->data;
+
+    items = palloc((Size) eset->nall * item_size);
+    memcpy(items, eset->data, (Size) eset->nall * item_size);
+
+    swap_items(items, eset->nall, item_size);
+    eset->sort_items(eset, items, eset->nall);
+
+    return items;
+}
+
+/*
+ * Private copy of deserialized 2/4/8B items in the native order (integers
+ * decoded from the delta encoding are fine as they are). By-reference items
+ * need their original bytes, sorted the native way.
+ */
+static void
+set_native_items(element_set_t * eset, uint8 encoding)
+{
+    int     item_size = eset->item_size;
+    bool    byref = (eset->vtype.kind == VALUE_BYREF);
+
+    if ((item_size != 2) && (item_size != 4) && (item_size != 8))
+        return;
+
+    if (eset->mode == SET_MODE_BITMAP)
+    {
+        swap_items(eset->data, eset->nbytes / sizeof(uint64), sizeof(uint64));
+
+        if (! byref)
+            return;
+
+        bitmap_to_array(eset);
+        encoding = SET_ENCODING_DELTA;
+    }
+    else if ((encoding == SET_ENCODING_DELTA) && (! byref))
+        return;
+    else
+        set_materialize(eset);
+
+    /* raw integers, or by-reference items decoded as integers */
+    if ((encoding == SET_ENCODING_RAW) != byref)
+        swap_items(eset->data, eset->nall, item_size);
+
+    if (byref)
+        eset->sort_items(eset, eset->data, eset->nall);
+}
+#endif
+
+/*
+ * Read-only set pointing to the serialized data (see set_header_t). The data
+ * are not copied, so they need to live as long as the set. The checks here
+ * are cheap - just the header, and that the length matches. Sets read from
+ * user input are checked more thoroughly by set_check_items.
+ */
+static element_set_t *
+set_from_bytes(char * ptr, Size len, MemoryContext aggcontext)
+{
+    element_set_t  *eset;
+    set_header_t    header;
+    bool            native;
+    int             header_len;
+
+    if ((len < SET_HEADER_BYTES) && ((len < SET_HEADER_V1_BYTES) || (ptr[0] != 1)))
+        elog(ERROR, "invalid lrtm_count_distinct state (too short)");
+
+    header_len = set_header_read(ptr, &header);
+    ptr += header_len;
+    len -= header_len;
+
+    if ((header.version != 1) && (header.version != SET_FORMAT_VERSION))
+        elog(ERROR, "unsupported lrtm_count_distinct state version %d", header.version);
+
+    /* version 1 states are in the native byte order */
+    native = (header.version == 1);
+
+    if ((header.mode != SET_MODE_ARRAY) && (header.mode != SET_MODE_SKETCH) &&
+        (header.mode != SET_MODE_BITMAP))
+        elog(ERROR, "invalid lrtm_count_distinct state (unknown mode %d)", header.mode);
+
+    if ((header.kind > VALUE_FINGERPRINT) || (header.order > VALUE_ORDER_FLOAT) ||
+        (header.item_size == 0))
+        elog(ERROR, "invalid lrtm_count_distinct state (invalid value type)");
+
+    /* hashes are 64-bit, and only by-value items have the typed order */
+    if (((header.kind == VALUE_FINGERPRINT) && (header.item_size != sizeof(uint64))) ||
+        ((header.kind == VALUE_BYVAL) && (header.item_size > sizeof(Datum))) ||
+        ((header.kind != VALUE_BYVAL) && (header.order != VALUE_ORDER_UNSIGNED)))
+        elog(ERROR, "invalid lrtm_count_distinct state (invalid value type)");
+
+    if ((header.encoding != SET_ENCODING_RAW) && (header.encoding != SET_ENCODING_DELTA))
+        elog(ERROR, "invalid lrtm_count_distinct state (unknown encoding %d)", header.encoding);
+
+    if (header.mode == SET_MODE_SKETCH)
+    {
+        if ((header.encoding != SET_ENCODING_RAW) ||
+            (len != HLL_NREGISTERS(HLL_DEFAULT_PRECISION)))
+            elog(ERROR, "invalid lrtm_count_distinct state (unexpected length)");
+    }
+    else if (header.mode == SET_MODE_BITMAP)
+    {
+        uint64  base;
+        uint64  nwords;
+
+        if ((header.encoding != SET_ENCODING_RAW) || (header.kind == VALUE_FINGERPRINT) ||
+            ((header.item_size != 1) && (header.item_size != 2) &&
+             (header.item_size != 4) && (header.item_size != 8)))
+            elog(ERROR, "invalid lrtm_count_distinct state (unexpected bitmap)");
+
+        if ((header.nitems == 0) || (len <= sizeof(uint64)) || (len % sizeof(uint64) != 0))
+            elog(ERROR, "invalid lrtm_count_distinct state (unexpected length)");
+
+        if (native)
+            memcpy(&base, ptr, sizeof(uint64));
+        else
+            base = load_le(ptr, sizeof(uint64));
+
+        nwords = len / sizeof(uint64) - 1;
+
+        /* the words have to be within the keys of the item size */
+        if ((base % 64 != 0) || (base > ITEM_MASK(header.item_size)) ||
+            (nwords - 1 > (ITEM_MASK(header.item_size) - base) / 64))
+            elog(ERROR, "invalid lrtm_count_distinct state (bitmap out of range)");
+    }
+    else
+    {
+        if (header.nitems == 0)
+            elog(ERROR, "invalid lrtm_count_distinct state (no items)");
+
+        if ((header.encoding == SET_ENCODING_RAW) &&
+            (len != (Size) header.nitems * header.item_size))
+            elog(ERROR, "invalid lrtm_count_distinct state (unexpected length)");
+
+        if ((header.encoding == SET_ENCODING_DELTA) && (header.item_size > sizeof(uint64)))
+            elog(ERROR, "invalid lrtm_count_distinct state (unexpected encoding)");
+    }
+
+    eset = (element_set_t *)palloc0(sizeof(element_set_t));
+
+    eset->item_size = header.item_size;
+    eset->mode = header.mode;
+    eset->max_bytes = header.max_bytes;
+    eset->nall = eset->nsorted = header.nitems;
+    eset->aggctx = aggcontext;
+    eset->sort_items = choose_sort_kernel(eset->item_size);
+
+    /* we don't get the full type info, but this is enough for the final functions */
+    eset->vtype.kind = header.kind;
+    eset->vtype.typalign = header.typalign;
+    eset->vtype.order = header.order;
+    eset->vtype.typbyval = (header.kind == VALUE_BYVAL);
+    eset->vtype.typlen = (header.kind == VALUE_FINGERPRINT) ? -1 : header.item_size;
+    eset->vtype.typid = header.typid;
+    eset->vtype.collation = InvalidOid;
+    eset->vtype.hash_proc = NULL;
+
+    /* combine ORs into bitmaps in place, so make a copy right away */
+    if (header.mode == SET_MODE_BITMAP)
+    {
+        if (native)
+            memcpy(&eset->base, ptr, sizeof(uint64));
+        else
+            eset->base = load_le(ptr, sizeof(uint64));
+
+        eset->readonly = false;
+        eset->encoding = SET_ENCODING_RAW;
+        eset->nbytes = len - sizeof(uint64);
+
+        if (eset->nbytes <= SET_INLINE_BYTES)
+            eset->data = (char *) eset->inline_data;
+        else
+            eset->data = MemoryContextAlloc(aggcontext, eset->nbytes);
+
+        memcpy(eset->data, ptr + sizeof(uint64), eset->nbytes);
+
+#ifdef WORDS_BIGENDIAN
+        if (! native)
+            set_native_items(eset, header.encoding);
+#endif
+
+        return eset;
+    }
+
+    eset->readonly = true;
+    eset->encoding = header.encoding;
+    eset->nbytes = len;
+    eset->data = ptr;
+
+#ifdef WORDS_BIGENDIAN
+    if ((! native) && (header.mode == SET_MODE_ARRAY))
+        set_native_items(eset, header.encoding);
+#endif
+
+    return eset;
+}
+
+/*
+ * Check that the items of a (read-only) set are really sorted and distinct,
+ * and that delta-encoded values fit into the items. A bitmap has to have as
+ * many bits set as it claims items.
+ */
+static void
+set_check_items(element_set_t * eset)
+{
+    run_reader_t    reader;
+    char           *prev;
+    uint32          i = 0;
+
+    if (eset->mode == SET_MODE_SKETCH)
+        return;
+
+    if (eset->mode == SET_MODE_BITMAP)
+    {
+        if (pg_popcount(eset->data, eset->nbytes) != eset->nall)
+            elog(ERROR, "invalid lrtm_count_distinct state (unexpected number of items)");
+
+        return;
+    }
+
+    prev = palloc(eset->item_size);
+
+    reader_init(&reader, eset);
+
+    while (reader_next(&reader))
+    {
+        if ((reader.encoding == SET_ENCODING_DELTA) &&
+            (reader.value > ITEM_MASK(eset->item_size)))
+            elog(ERROR, "invalid lrtm_count_distinct state (value out of range)");
+
+        if ((i > 0) && (compare_values(prev, reader.item, eset->item_size) >= 0))
+            elog(ERROR, "invalid lrtm_count_distinct state (items not sorted)");
+
+        memcpy(prev, reader.item, eset->item_size);
+        i++;
+    }
+
+    if ((reader.encoding == SET_ENCODING_DELTA) && (reader.ptr != reader.end))
+        elog(ERROR, "invalid lrtm_count_distinct state (trailing data)");
+
+    pfree(prev);
+}
+
+/* sets of values of different types can't be combined or compared */
+static void
+check_same_type(element_set_t * eset1, element_set_t * eset2)
+{
+    /* can't happen in parallel aggregation, but stored sets may be of any type */
+    if ((eset1->item_size != eset2->item_size) ||
+        (eset1->vtype.kind != eset2->vtype.kind) ||
+        (eset1->vtype.order != eset2->vtype.order))
+        elog(ERROR, "can't combine sets of values of different types");
+
+    /* unknown for version 1 states and user-defined types */
+    if (OidIsValid(eset1->vtype.typid) && OidIsValid(eset2->vtype.typid) &&
+        (eset1->vtype.typid != eset2->vtype.typid))
+        elog(ERROR, "can't combine sets of values of different types (%s and %s)",
+             format_type_be(eset1->vtype.typid), format_type_be(eset2->vtype.typid));
+
+    /* the result of a union gets the known type */
+    if (! OidIsValid(eset1->vtype.typid))
+        eset1->vtype.typid = eset2->vtype.typid;
+}
+
+/*
+ * Number of items in both (read-only) sets in array mode. When one set is
+ * much smaller and the other one can be accessed randomly (not delta-encoded),
+ * the items are searched for, otherwise the sets are walked like in a merge.
+ * Bitmaps are probed (or ANDed) directly.
+ */
+static int64
+intersect_count(element_set_t * eset1, element_set_t * eset2)
+{
+    if (eset1->mode == SET_MODE_BITMAP)
+        return intersect_count_bitmap(eset1, eset2);
+
+    if (eset2->mode == SET_MODE_BITMAP)
+        return intersect_count_bitmap(eset2, eset1);
+
+    Assert(eset1->readonly && eset2->readonly);
+    Assert((eset1->mode == SET_MODE_ARRAY) && (eset2->mode == SET_MODE_ARRAY));
+
+    if (eset1->nall > eset2->nall)
+    {
+        element_set_t  *tmp = eset1;
+
+        eset1 = eset2;
+        eset2 = tmp;
+    }
+
+    if ((eset2->encoding == SET_ENCODING_RAW) &&
+        ((double) eset1->nall * GALLOP_MIN_RATIO < eset2->nall))
+        return intersect_count_gallop(eset1, eset2);
+
+    return intersect_count_linear(eset1, eset2);
+}
+
+static int64
+intersect_count_linear(element_set_t * eset1, element_set_t * eset2)
+{
+    run_reader_t    reader1;
+    run_reader_t    reader2;
+    int64           count = 0;
+    bool            more1;
+    bool            more2;
+
+    reader_init(&reader1, eset1);
+    reader_init(&reader2, eset2);
+
+    more1 = reader_next(&reader1);
+    more2 = reader_next(&reader2);
+
+    while (more1 && more2)
+    {
+        int r = compare_values(reader1.item, reader2.item, eset1->item_size);
+
+        if (r == 0)
+            count++;
+
+        if (r <= 0)
+            more1 = reader_next(&reader1);
+
+        if (r >= 0)
+            more2 = reader_next(&reader2);
+    }
+
+    return count;
+}
+
+/*
+ * Look up the items of the small set in the large one (raw, sorted). Each
+ * search starts where the previous one ended, and first doubles the step
+ * until it gets past the item, so the cost is O(n * log(m / n)).
+ */
+static int64
+intersect_count_gallop(element_set_t * small, element_set_t * large)
+{
+    run_reader_t    reader;
+    int             item_size = large->item_size;
+    const char     *data = large->data;
+    uint32          start = 0;
+    int64           count = 0;
+
+    Assert(large->encoding == SET_ENCODING_RAW);
+
+    reader_init(&reader, small);
+
+    while ((start < large->nall) && reader_next(&reader))
+    {
+        uint32  step = 1;
+        uint32  lo = start;
+        uint32  hi;
+
+        /* find range (lo, hi] with item[lo] < value <= item[hi] (or past the end) */
+        if (compare_values(data + (Size) lo * item_size, reader.item, item_size) >= 0)
+            hi = lo;
+        else
+        {
+            while (true)
+            {
+                hi = (large->nall - lo > step) ? lo + step : large->nall;
+
+                if ((hi == large->nall) ||
+                    (compare_values(data + (Size) hi * item_size, reader.item, item_size) >= 0))
+                    break;
+
+                lo = hi;
+                step *= 2;
+            }
+
+            /* binary search for the first item >= value */
+            while (hi - lo > 1)
+            {
+                uint32  mid = lo + (hi - lo) / 2;
+
+                if (compare_values(data + (Size) mid * item_size, reader.item, item_size) < 0)
+                    lo = mid;
+                else
+                    hi = mid;
+            }
+        }
+
+        if ((hi < large->nall) &&
+            (compare_values(data + (Size) hi * item_size, reader.item, item_size) == 0))
+        {
+            count++;
+            hi++;
+        }
+
+        start = hi;
+    }
+
+    return count;
+}
+
+/*
+ * Intersection with a bitmap - the overlapping words of another bitmap are
+ * ANDed and counted, the items of an array are looked up.
+ */
+static int64
+intersect_count_bitmap(element_set_t * bitmap, element_set_t * other)
+{
+    const uint64   *words = (const uint64 *) bitmap->data;
+    uint64          nbits = (uint64) bitmap->nbytes * 8;
+    int64           count = 0;
+
+    if (other->mode == SET_MODE_BITMAP)
+    {
+        const uint64   *other_words = (const uint64 *) other->data;
+        uint64          first = Max(bitmap->base, other->base);
+        uint64          last = Min(bitmap->base + (nbits - 1),
+                                   other->base + ((uint64) other->nbytes * 8 - 1));
+        uint64          i;
+
+        if (first > last)
+            return 0;
+
+        words += (first - bitmap->base) / 64;
+        other_words += (first - other->base) / 64;
+
+        for (i = 0; i <= (last - first) / 64; i++)
+            count += pg_popcount64(words[i] & other_words[i]);
+    }
+    else
+    {
+        run_reader_t    reader;
+
+        reader_init(&reader, other);
+
+        while (reader_next(&reader))
+        {
+            uint64  offset = load_item(reader.item, bitmap->item_size) - bitmap->base;
+
+            if ((offset < nbits) && ((words[offset / 64] >> (offset % 64)) & 1))
+                count++;
+        }
+    }
+
+    return count;
+}
+
+/*
+ * Estimated size of the union of two sets, at least one of them a sketch (the
+ * other one gets converted to a sketch too).
+ */
+static double
+sketch_union_estimate(element_set_t * eset1, element_set_t * eset2)
+{
+    uint8  *registers;
+    int     i;
+
+    set_to_sketch(eset1);
+    set_to_sketch(eset2);
+
+    registers = palloc(eset1->nbytes);
+
+    for (i = 0; i < eset1->nbytes; i++)
+        registers[i] = Max((uint8) eset1->data[i], (uint8) eset2->data[i]);
+
+    return hll_estimate(registers, HLL_DEFAULT_PRECISION);
+}
+
+static counted_set_t *
+counted_init(value_type_t * vtype)
+{
+    counted_set_t  *cset = (counted_set_t *) palloc0(sizeof(counted_set_t));
+
+    cset->vtype = *vtype;
+    cset->item_size = value_item_size(vtype);
+    cset->nslots = COUNTED_INIT_SLOTS;
+    cset->items = palloc((Size) cset->nslots * cset->item_size);
+    cset->counts = palloc0((Size) cset->nslots * sizeof(uint64));
+
+    return cset;
+}
+
+/* slot with the item, or the empty slot where it belongs */
+static uint32
+counted_find(counted_set_t * cset, char * item)
+{
+    uint32  mask = cset->nslots - 1;
+    uint32  slot = (uint32) hash_item(item, cset->item_size) & mask;
+
+    while (cset->counts[slot] > 0)
+    {
+        if (memcmp(cset->items + (Size) slot * cset->item_size, item, cset->item_size) == 0)
+            break;
+
+        slot = (slot + 1) & mask;
+    }
+
+    return slot;
+}
+
+static void
+counted_add(counted_set_t * cset, char * item, uint64 count)
+{
+    uint32  slot;
+
+    if (cset->nitems + 1 > cset->nslots * HASH_MAX_FILL)
+        counted_grow(cset);
+
+    slot = counted_find(cset, item);
+
+    if (cset->counts[slot] == 0)
+    {
+        memcpy(cset->items + (Size) slot * cset->item_size, item, cset->item_size);
+        cset->nitems++;
+    }
+
+    cset->counts[slot] += count;
+}
+
+/*
+ * Decrement the count of the item, and delete it once it drops to zero. The
+ * deletion shifts the following items of the cluster back, so that lookups
+ * don't need tombstones.
+ */
+static void
+counted_remove(counted_set_t * cset, char * item)
+{
+    uint32  mask = cset->nslots - 1;
+    uint32  slot = counted_find(cset, item);
+    uint32  next;
+
+    if (cset->counts[slot] == 0)
+        elog(ERROR, "value removed from lrtm_count_distinct moving state was not added");
+
+    if (--cset->counts[slot] > 0)
+        return;
+
+    cset->nitems--;
+
+    for (next = (slot + 1) & mask; cset->counts[next] > 0; next = (next + 1) & mask)
+    {
+        char   *next_item = cset->items + (Size) next * cset->item_size;
+        uint32  home = (uint32) hash_item(next_item, cset->item_size) & mask;
+
+        /* keep the item if its home slot is (cyclically) in (slot, next] */
+        if (((next - home) & mask) < ((next - slot) & mask))
+            continue;
+
+        memcpy(cset->items + (Size) slot * cset->item_size, next_item, cset->item_size);
+        cset->counts[slot] = cset->counts[next];
+        cset->counts[next] = 0;
+
+        slot = next;
+    }
+}
+
+static void
+counted_grow(counted_set_t * cset)
+{
+    char       *items = cset->items;
+    uint64     *counts = cset->counts;
+    uint32      nslots = cset->nslots;
+    uint32      i;
+
+    cset->nslots *= 2;
+    cset->items = palloc((Size) cset->nslots * cset->item_size);
+    cset->counts = palloc0((Size) cset->nslots * sizeof(uint64));
+
+    for (i = 0; i < nslots; i++)
+    {
+        char   *item = items + (Size) i * cset->item_size;
+        uint32  slot;
+
+        if (counts[i] == 0)
+            continue;
+
+        slot = counted_find(cset, item);
+
+        memcpy(cset->items + (Size) slot * cset->item_size, item, cset->item_size);
+        cset->counts[slot] = counts[i];
+    }
+
+    pfree(items);
+    pfree(counts);
+}
+
+/* is the item in slot a less frequent than the one in slot b (larger on ties)? */
+static inline bool
+counted_less(counted_set_t * cset, uint32 a, uint32 b)
+{
+    if (cset->counts[a] != cset->counts[b])
+        return (cset->counts[a] < cset->counts[b]);
+
+    return compare_values(cset->items + (Size) a * cset->item_size,
+                          cset->items + (Size) b * cset->item_size,
+                          cset->item_size) > 0;
+}
+
+static void
+counted_sift_down(counted_set_t * cset, uint32 * heap, uint32 n, uint32 j)
+{
+    uint32  slot = heap[j];
+
+    while (true)
+    {
+        uint32  child = 2 * j + 1;
+
+        if (child >= n)
+            break;
+
+        if ((child + 1 < n) && counted_less(cset, heap[child + 1], heap[child]))
+            child++;
+
+        if (! counted_less(cset, heap[child], slot))
+            break;
+
+        heap[j] = heap[child];
+        j = child;
+    }
+
+    heap[j] = slot;
+}
+
+/*
+ * Slots of the k most frequent items, the most frequent first (and smaller
+ * items first on ties, so the result does not depend on the table layout).
+ * A min-heap of the k best items seen so far needs just O(n log k) time.
+ * The slots array needs space for Min(k, nitems) slots.
+ */
+static uint32
+counted_top(counted_set_t * cset, uint32 * slots)
+{
+    uint32  k = Min(cset->k, cset->nitems);
+    uint32  n = 0;
+    uint32  i;
+
+    if (k == 0)
+        return 0;
+
+    for (i = 0; i < cset->nslots; i++)
+    {
+        uint32  j;
+
+        if (cset->counts[i] == 0)
+            continue;
+
+        if (n == k)
+        {
+            /* replace the least frequent of the k items, if this one is better */
+            if (counted_less(cset, slots[0], i))
+            {
+                slots[0] = i;
+                counted_sift_down(cset, slots, n, 0);
+            }
+            continue;
+        }
+
+        /* sift up */
+        j = n++;
+        while ((j > 0) && counted_less(cset, i, slots[(j - 1) / 2]))
+        {
+            slots[j] = slots[(j - 1) / 2];
+            j = (j - 1) / 2;
+        }
+        slots[j] = i;
+    }
+
+    /* heap sort, the least frequent item goes to the end */
+    for (i = n; i > 1; i--)
+    {
+        uint32  slot = slots[0];
+
+        slots[0] = slots[i - 1];
+        counted_sift_down(cset, slots, i - 1, 0);
+        slots[i - 1] = slot;
+    }
+
+    return n;
+}
+
+/* grouped state with space for maxpairs pairs (vtype NULL - deserialized) */
+static grouped_state_t *
+grouped_init(value_type_t * vtype, MemoryContext ctx, Size maxpairs)
+{
+    grouped_state_t *gstate = MemoryContextAllocZero(ctx, sizeof(grouped_state_t));
+
+    if (vtype != NULL)
+        gstate->vtype = *vtype;
+
+    gstate->ctx = ctx;
+    gstate->maxpairs = maxpairs;
+    gstate->pairs = MemoryContextAllocHuge(ctx, maxpairs * sizeof(grouped_pair_t));
+
+    return gstate;
+}
+
+/*
+ * Make space for nnew more pairs - compact the pairs first, and grow the
+ * array if that did not free enough space. When the last compaction found
+ * few duplicates, the array grows right away (and the next time compacts
+ * again), just like the sets.
+ */
+static void
+grouped_reserve(grouped_state_t * gstate, Size nnew)
+{
+    Size    maxpairs = gstate->maxpairs;
+
+    if (gstate->npairs + nnew <= gstate->maxpairs)
+        return;
+
+    if (gstate->few_dups)
+        gstate->few_dups = false;
+    else
+    {
+        Size    ninput = gstate->npairs;
+        Size    nappended = gstate->npairs - gstate->ndistinct;
+
+        grouped_compact(gstate);
+
+        gstate->few_dups = ((ninput - gstate->npairs) < nappended * ARRAY_FEW_DUPS_FRACT);
+    }
+
+    while ((gstate->npairs + nnew) > maxpairs * (1.0 - ARRAY_FREE_FRACT))
+        maxpairs *= 2;
+
+    if (maxpairs != gstate->maxpairs)
+    {
+        gstate->pairs = repalloc_huge(gstate->pairs, maxpairs * sizeof(grouped_pair_t));
+        gstate->maxpairs = maxpairs;
+    }
+}
+
+/*
+ * Remove duplicate pairs. The pairs are first partitioned by a hash of the
+ * group, into partitions small enough to be sorted in cache (a single
+ * scatter pass, into a new array), and then each partition gets sorted by
+ * (group, value) and deduplicated, moving the distinct pairs to the front.
+ * All pairs of a group are in the same partition, so the pairs of a group
+ * end up contiguous (and sorted).
+ */
+static void
+grouped_compact(grouped_state_t * gstate)
+{
+    grouped_pair_t *pairs = gstate->pairs;
+    grouped_pair_t *scratch;
+    Size   *offsets;
+    Size    npairs = gstate->npairs;
+    Size    nparts = 1;
+    Size    maxpart = 0;
+    Size    out = 0;
+    Size    i, p;
+    int     bits = 0;
+
+    /* nothing new since the last compaction */
+    if (gstate->npairs == gstate->ndistinct)
+        return;
+
+    while ((nparts < GROUPED_MAX_PARTITIONS) && (npairs / nparts > GROUPED_PARTITION_PAIRS))
+    {
+        nparts *= 2;
+        bits++;
+    }
+
+    offsets = palloc0((nparts + 1) * sizeof(Size));
+
+    if (nparts > 1)
+    {
+        grouped_pair_t *parts;
+        Size           *next;
+
+        for (i = 0; i < npairs; i++)
+            offsets[(hash_key(pairs[i].group) >> (64 - bits)) + 1]++;
+
+        for (p = 0; p < nparts; p++)
+            offsets[p + 1] += offsets[p];
+
+        next = palloc(nparts * sizeof(Size));
+        memcpy(next, offsets, nparts * sizeof(Size));
+
+        parts = MemoryContextAllocHuge(gstate->ctx, gstate->maxpairs * sizeof(grouped_pair_t));
+
+        for (i = 0; i < npairs; i++)
+            parts[next[hash_key(pairs[i].group) >> (64 - bits)]++] = pairs[i];
+
+        pfree(next);
+        pfree(pairs);
+
+        pairs = gstate->pairs = parts;
+    }
+    else
+        offsets[1] = npairs;
+
+    for (p = 0; p < nparts; p++)
+        maxpart = Max(maxpart, offsets[p + 1] - offsets[p]);
+
+    scratch = MemoryContextAllocHuge(CurrentMemoryContext, Max(maxpart, 1) * sizeof(grouped_pair_t));
+
+    for (p = 0; p < nparts; p++)
+    {
+        grouped_pair_t *part = pairs + offsets[p];
+        Size            n = offsets[p + 1] - offsets[p];
+
+        sort_pairs(part, n, scratch);
+
+        /* groups differ between partitions, so compare to the last output pair */
+        for (i = 0; i < n; i++)
+        {
+            grouped_pair_t  v = part[i];
+            bool            is_new = (out == 0) ||
+                                     (v.group != pairs[out - 1].group) ||
+                                     (v.value != pairs[out - 1].value);
+
+            pairs[out] = v;
+            out += is_new;
+        }
+    }
+
+    pfree(scratch);
+    pfree(offsets);
+
+    gstate->npairs = gstate->ndistinct = out;
+}
+
+/*
+ * LSD radix sort of the pairs by (group, value), one pass per byte, the
+ * value bytes first. Bytes that are the same in all the pairs are found
+ * first (a partition usually has only a few distinct bytes), so that they
+ * don't even need histograms. Short runs use insertion sort.
+ */
+static void
+sort_pairs(grouped_pair_t * pairs, Size npairs, grouped_pair_t * scratch)
+{
+    grouped_pair_t *src, *dst, *tmp;
+    Size    counts[16][256];
+    int     bytes[16];
+    int     nbytes = 0;
+    uint64  group_diff = 0;
+    uint64  value_diff = 0;
+    Size    i;
+    int     d, k;
+
+#define PAIR_BYTE(pair, d) \
+    (((d) < 8) ? (((pair).value >> (8 * (d))) & 0xFF) : (((pair).group >> (8 * ((d) - 8))) & 0xFF))
+
+    if (npairs < RADIX_SORT_MIN_ITEMS)
+    {
+        for (i = 1; i < npairs; i++)
+        {
+            grouped_pair_t  v = pairs[i];
+            Size            j = i;
+
+            while ((j > 0) &&
+                   ((pairs[j - 1].group > v.group) ||
+                    ((pairs[j - 1].group == v.group) && (pairs[j - 1].value > v.value))))
+            {
+                pairs[j] = pairs[j - 1];
+                j--;
+            }
+            pairs[j] = v;
+        }
+        return;
+    }
+
+    /* bits differing between the pairs */
+    for (i = 1; i < npairs; i++)
+    {
+        group_diff |= pairs[i].group ^ pairs[0].group;
+        value_diff |= pairs[i].value ^ pairs[0].value;
+    }
+
+    for (d = 0; d < 16; d++)
+    {
+        uint64  diff = (d < 8) ? (value_diff >> (8 * d)) : (group_diff >> (8 * (d - 8)));
+
+        if (diff & 0xFF)
+            bytes[nbytes++] = d;
+    }
+
+    for (k = 0; k < nbytes; k++)
+        memset(counts[bytes[k]], 0, sizeof(counts[0]));
+
+    for (i = 0; i < npairs; i++)
+        for (k = 0; k < nbytes; k++)
+            counts[bytes[k]][PAIR_BYTE(pairs[i], bytes[k])]++;
+
+    src = pairs;
+    dst = scratch;
+
+    for (k = 0; k < nbytes; k++)
+    {
+        Size    offset = 0;
+
+        d = bytes[k];
+
+        for (i = 0; i < 256; i++)
+        {
+            Size    cnt = counts[d][i];
+            counts[d][i] = offset;
+            offset += cnt;
+        }
+
+        for (i = 0; i < npairs; i++)
+            dst[counts[d][PAIR_BYTE(src[i], d)]++] = src[i];
+
+        tmp = src;
+        src = dst;
+        dst = tmp;
+    }
+
+#undef PAIR_BYTE
+
+    /* odd number of passes, so the sorted pairs are in the scratch buffer */
+    if (src != pairs)
+        memcpy(pairs, src, npairs * sizeof(grouped_pair_t));
+}
+
+/* memory limit for sets that spill to temporary files (0 - never spill) */
+static Size
+spill_limit(void)
+{
+    if (spill_bytes == 0)
+        return 0;
+
+    if (spill_bytes == SPILL_BYTES_WORK_MEM)
+        return Max((Size) work_mem * 1024, SPILL_MIN_BYTES);
+
+    return Max((Size) spill_bytes, SPILL_MIN_BYTES);
+}
+
+/* the data array can't grow past this (0 - no limit) */
+static Size
+set_memory_limit(element_set_t * eset)
+{
+    if (eset->max_bytes > 0)
+        return eset->max_bytes;
+
+    return spill_limit();
+}
+
+/*
+ * Write the (compacted) items to the temporary file as a new run, and empty
+ * the array (keeping the allocated space for the next items).
+ */
+static void
+set_spill(element_set_t * eset)
+{
+    set_spill_t    *spill;
+    int             fileno;
+    off_t           offset;
+
+    Assert(eset->mode == SET_MODE_ARRAY);
+    Assert(eset->nall == eset->nsorted);
+    Assert(eset->nruns == 0);
+    Assert(! eset->readonly);
+
+    if (eset->nall == 0)
+        return;
+
+    spill = spill_create(eset);
+
+    fileno = spill->end_fileno;
+    offset = spill->end_offset;
+
+    spill_write(spill, eset->data, (Size) eset->nall * eset->item_size);
+
+    SET_STATS_ADD(eset, spilled_bytes, (Size) eset->nall * eset->item_size);
+    spill_add_run(eset, fileno, offset, eset->nall, 0);
+
+    eset->nall = eset->nsorted = 0;
+    eset->few_dups = false;
+}
+
+/* the temporary file of the set (created on the first spill) */
+static set_spill_t *
+spill_create(element_set_t * eset)
+{
+    set_spill_t    *spill;
+    MemoryContext   oldcontext;
+
+    if (eset->spill != NULL)
+        return eset->spill;
+
+    oldcontext = MemoryContextSwitchTo(eset->aggctx);
+
+    spill = (set_spill_t *) palloc0(sizeof(set_spill_t));
+
+    PrepareTempTablespaces();
+    spill->file = BufFileCreateTemp(false);
+    BufFileTell(spill->file, &spill->end_fileno, &spill->end_offset);
+
+    /* close the file with the context, unless spill_free does it earlier */
+    spill->reset = palloc(sizeof(spill_reset_t));
+    spill->reset->file = spill->file;
+    spill->reset->subid = GetCurrentSubTransactionId();
+    spill->reset->next = open_spills;
+    spill->reset->callback.func = spill_reset;
+    spill->reset->callback.arg = spill->reset;
+
+    MemoryContextRegisterResetCallback(eset->aggctx, &spill->reset->callback);
+    open_spills = spill->reset;
+
+    spill->maxruns = SPILL_MERGE_FANIN;
+    spill->runs = palloc(spill->maxruns * sizeof(set_spill_run_t));
+    spill->buffer = palloc(SPILL_CHUNK_BYTES);
+
+    MemoryContextSwitchTo(oldcontext);
+
+    eset->spill = spill;
+
+    return spill;
+}
+
+static void
+spill_reset(void * arg)
+{
+    spill_reset_t  *reset = (spill_reset_t *) arg;
+
+    if (reset->file != NULL)
+    {
+        BufFileClose(reset->file);
+        spill_forget(reset);
+    }
+}
+
+/* the file is closed (or will be, by the resource owner) */
+static void
+spill_forget(spill_reset_t * reset)
+{
+    spill_reset_t **ptr = &open_spills;
+
+    while (*ptr != reset)
+        ptr = &(*ptr)->next;
+
+    *ptr = reset->next;
+    reset->file = NULL;
+}
+
+/* files of an aborted transaction are closed by the resource owner */
+static void
+spill_xact_callback(XactEvent event, void * arg)
+{
+    if ((event == XACT_EVENT_ABORT) || (event == XACT_EVENT_PARALLEL_ABORT))
+    {
+        while (open_spills != NULL)
+            spill_forget(open_spills);
+    }
+}
+
+static void
+spill_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+                       SubTransactionId parentSubid, void * arg)
+{
+    spill_reset_t  *reset = open_spills;
+
+    while (reset != NULL)
+    {
+        spill_reset_t  *next = reset->next;
+
+        if (reset->subid == mySubid)
+        {
+            /* the parent resource owner gets the files of a committed one */
+            if (event == SUBXACT_EVENT_COMMIT_SUB)
+                reset->subid = parentSubid;
+            else if (event == SUBXACT_EVENT_ABORT_SUB)
+                spill_forget(reset);
+        }
+
+        reset = next;
+    }
+}
+
+/*
+ * Remember a run written to the file. The runs are kept ordered by level
+ * (from the highest), and once there are SPILL_MERGE_FANIN runs of the same
+ * level, they get merged, like in a LSM tree.
+ */
+static void
+spill_add_run(element_set_t * eset, int fileno, off_t offset, uint32 nitems, int level)
+{
+    set_spill_t    *spill = eset->spill;
+    int             first = 0;
+
+    spill_insert_run(spill, fileno, offset, nitems, level);
+
+    /* the runs of the same level are next to each other */
+    while (first + SPILL_MERGE_FANIN <= spill->nruns)
+    {
+        if (spill->runs[first].level == spill->runs[first + SPILL_MERGE_FANIN - 1].level)
+        {
+            spill_merge_level(eset, first);
+            first = 0;
+        }
+        else
+            first++;
+    }
+}
+
+static void
+spill_insert_run(set_spill_t * spill, int fileno, off_t offset, uint32 nitems, int level)
+{
+    int     pos = spill->nruns;
+
+    if (spill->nruns == spill->maxruns)
+    {
+        spill->maxruns *= 2;
+        spill->runs = repalloc(spill->runs, spill->maxruns * sizeof(set_spill_run_t));
+    }
+
+    while ((pos > 0) && (spill->runs[pos - 1].level < level))
+        pos--;
+
+    memmove(&spill->runs[pos + 1], &spill->runs[pos],
+            (spill->nruns - pos) * sizeof(set_spill_run_t));
+
+    spill->runs[pos].fileno = fileno;
+    spill->runs[pos].offset = offset;
+    spill->runs[pos].nitems = nitems;
+    spill->runs[pos].level = level;
+    spill->nruns++;
+}
+
+/*
+ * Move all items of a spilled set (in memory and in its file) into the file
+ * of another set, as a single merged run. The source set can't be used
+ * anymore.
+ */
+static void
+spill_absorb(element_set_t * eset, element_set_t * src)
+{
+    set_spill_t    *spill = spill_create(eset);
+    run_reader_t   *readers;
+    int             nreaders;
+    int             fileno = spill->end_fileno;
+    off_t           offset = spill->end_offset;
+    int             level = 0;
+    Size            nitems;
+    int             i;
+
+    compact_set(src, false);
+
+    readers = palloc((src->spill->nruns + 1) * sizeof(run_reader_t));
+
+    reader_init(&readers[0], src);
+    nreaders = spill_init_readers(src, readers, 1);
+
+    nitems = kway_merge(readers, nreaders, src->item_size, NULL, spill);
+
+    SET_STATS_ADD(eset, combine_bytes, nitems * src->item_size);
+    SET_STATS_ADD(eset, spilled_bytes, nitems * src->item_size);
+
+    if (spill->nbuffered > 0)
+    {
+        spill_write(spill, spill->buffer, spill->nbuffered);
+        spill->nbuffered = 0;
+    }
+
+    for (i = 1; i < nreaders; i++)
+        pfree(readers[i].chunk);
+
+    pfree(readers);
+
+    /* the merged run is about as large as the largest source run */
+    for (i = 0; i < src->spill->nruns; i++)
+        level = Max(level, src->spill->runs[i].level);
+
+    spill_free(src);
+
+    if (nitems > 0)
+        spill_add_run(eset, fileno, offset, nitems, level);
+}
+
+/*
+ * Merge SPILL_MERGE_FANIN runs (all of the same level) starting at first into
+ * a run of the next level, written at the end of the file. The space used by
+ * the old runs is not reused, the file is only appended to.
+ */
+static void
+spill_merge_level(element_set_t * eset, int first)
+{
+    set_spill_t    *spill = eset->spill;
+    run_reader_t   *readers;
+    int             level = spill->runs[first].level;
+    int             fileno = spill->end_fileno;
+    off_t           offset = spill->end_offset;
+    Size            nitems;
+    int             i;
+
+    readers = palloc(SPILL_MERGE_FANIN * sizeof(run_reader_t));
+
+    for (i = 0; i < SPILL_MERGE_FANIN; i++)
+        reader_init_file(&readers[i], spill, &spill->runs[first + i], eset->item_size);
+
+    nitems = kway_merge(readers, SPILL_MERGE_FANIN, eset->item_size, NULL, spill);
+
+    SET_STATS_ADD(eset, spilled_bytes, nitems * eset->item_size);
+
+    /* write out the rest of the merged run */
+    if (spill->nbuffered > 0)
+    {
+        spill_write(spill, spill->buffer, spill->nbuffered);
+        spill->nbuffered = 0;
+    }
+
+    for (i = 0; i < SPILL_MERGE_FANIN; i++)
+        pfree(readers[i].chunk);
+
+    pfree(readers);
+
+    memmove(&spill->runs[first], &spill->runs[first + SPILL_MERGE_FANIN],
+            (spill->nruns - first - SPILL_MERGE_FANIN) * sizeof(set_spill_run_t));
+    spill->nruns -= SPILL_MERGE_FANIN;
+
+    spill_insert_run(spill, fileno, offset, nitems, level + 1);
+}
+
+/* load the spilled runs back, merged with the items in memory */
+static void
+set_unspill(element_set_t * eset)
+{
+    run_reader_t   *readers;
+    int             nreaders;
+    Size            nitems;
+    char           *data;
+    int             i;
+
+    Assert(eset->spill != NULL);
+
+    compact_set(eset, false);
+
+    nitems = eset->nall;
+    for (i = 0; i < eset->spill->nruns; i++)
+        nitems += eset->spill->runs[i].nitems;
+
+    if (nitems * eset->item_size > MaxAllocSize)
+        elog(ERROR, "the set is too large to be loaded into memory (%zu items)", nitems);
+
+    readers = palloc((eset->spill->nruns + 1) * sizeof(run_reader_t));
+
+    reader_init(&readers[0], eset);
+    nreaders = spill_init_readers(eset, readers, 1);
+
+    data = MemoryContextAlloc(eset->aggctx, Max(nitems * eset->item_size, 1));
+
+    nitems = kway_merge(readers, nreaders, eset->item_size, data, NULL);
+
+    for (i = 1; i < nreaders; i++)
+        pfree(readers[i].chunk);
+
+    pfree(readers);
+
+    spill_free(eset);
+    set_free_data(eset);
+
+    eset->data = data;
+    eset->nbytes = Max(nitems * eset->item_size, 1);
+    eset->nall = eset->nsorted = nitems;
+}
+
+/* close the temporary file and forget the spilled runs */
+static void
+spill_free(element_set_t * eset)
+{
+    BufFileClose(eset->spill->file);
+
+    /* the callback stays registered (and its memory allocated), as a no-op */
+    spill_forget(eset->spill->reset);
+
+    pfree(eset->spill->runs);
+    pfree(eset->spill->buffer);
+    pfree(eset->spill);
+
+    eset->spill = NULL;
+}
+
+/* readers for all the spilled runs, starting at readers[first] */
+static int
+spill_init_readers(element_set_t * eset, run_reader_t * readers, int first)
+{
+    int     i;
+
+    for (i = 0; i < eset->spill->nruns; i++)
+        reader_init_file(&readers[first + i], eset->spill, &eset->spill->runs[i],
+                         eset->item_size);
+
+    return first + eset->spill->nruns;
+}
+
+/* append data at the end of the file (readers may have moved the position) */
+static void
+spill_write(set_spill_t * spill, const char * data, Size nbytes)
+{
+    if (BufFileSeek(spill->file, spill->end_fileno, spill->end_offset, SEEK_SET) != 0)
+        elog(ERROR, "could not seek in lrtm_count_distinct temporary file");
+
+#if PG_VERSION_NUM >= 160000
+    BufFileWrite(spill->file, data, nbytes);
+#else
+    if (BufFileWrite(spill->file, (void *) data, nbytes) != nbytes)
+        elog(ERROR, "could not write to lrtm_count_distinct temporary file");
+#endif
+
+    BufFileTell(spill->file, &spill->end_fileno, &spill->end_offset);
+}
+
+/* add an item to the run being merged, writing it out in chunks */
+static void
+spill_append(set_spill_t * spill, const char * item, int item_size)
+{
+    if (spill->nbuffered + item_size > SPILL_CHUNK_BYTES)
+    {
+        spill_write(spill, spill->buffer, spill->nbuffered);
+        spill->nbuffered = 0;
+    }
+
+    memcpy(spill->buffer + spill->nbuffered, item, item_size);
+    spill->nbuffered += item_size;
+}
+
+static void
+reader_init_file(run_reader_t * reader, set_spill_t * spill,
+                 set_spill_run_t * run, int item_size)
+{
+    reader_init_run(reader, NULL, 0, run->nitems, item_size, SET_ENCODING_RAW);
+
+    reader->file = spill->file;
+    reader->fileno = run->fileno;
+    reader->offset = run->offset;
+    reader->chunk = palloc(SPILL_CHUNK_BYTES - SPILL_CHUNK_BYTES % item_size);
+}
+
+/* read the next chunk of a spilled run */
+static void
+reader_fill(run_reader_t * reader)
+{
+    Size    nbytes = SPILL_CHUNK_BYTES - SPILL_CHUNK_BYTES % reader->item_size;
+
+    if (reader->file == NULL)
+        elog(ERROR, "invalid lrtm_count_distinct state (unexpected end of run)");
+
+    nbytes = Min(nbytes, (Size) reader->remaining * reader->item_size);
+
+    if (BufFileSeek(reader->file, reader->fileno, reader->offset, SEEK_SET) != 0)
+        elog(ERROR, "could not seek in lrtm_count_distinct temporary file");
+
+    if (BufFileRead(reader->file, reader->chunk, nbytes) != nbytes)
+        elog(ERROR, "could not read from lrtm_count_distinct temporary file");
+
+    BufFileTell(reader->file, &reader->fileno, &reader->offset);
+
+    reader->ptr = reader->chunk;
+    reader->end = reader->chunk + nbytes;
+}
+
+/*
+ * Remember the memory used by the aggregate context, when collecting the
+ * statistics. The final functions run once all the input is in the states
+ * (of all groups, with hashed aggregation), so that's about the peak.
+ */
+static void
+track_context_peak(FunctionCallInfo fcinfo)
+{
+    MemoryContext   aggcontext;
+
+    if ((! track_stats) && (! log_stats))
+        return;
+
+    if (AggCheckCallContext(fcinfo, &aggcontext) && (aggcontext != NULL))
+        backend_peak_bytes = Max(backend_peak_bytes,
+                                 MemoryContextMemAllocated(aggcontext, true));
+}
+
+/* with lrtm_count_distinct.log_stats, log the counters of the set */
+static void
+log_set_stats(element_set_t * eset)
+{
+    set_stats_t *stats = eset->stats;
+
+    if ((! log_stats) || (stats == NULL))
+        return;
+
+    elog(LOG, "lrtm_count_distinct set: %s, %u items, %u bytes, %u runs, %d spilled runs, "
+              INT64_FORMAT " compactions, " INT64_FORMAT " items sorted, "
+              INT64_FORMAT " duplicates removed, " INT64_FORMAT " growths, "
+              INT64_FORMAT " bytes combined, " INT64_FORMAT " bytes serialized, "
+              INT64_FORMAT " bytes spilled",
+         (eset->mode == SET_MODE_ARRAY) ? "array" :
+            (eset->mode == SET_MODE_HASH) ? "hash" :
+            (eset->mode == SET_MODE_BITMAP) ? "bitmap" : "sketch",
+         eset->nall, eset->nbytes, eset->nruns,
+         (eset->spill != NULL) ? eset->spill->nruns : 0,
+         stats->compactions, stats->items_sorted, stats->dups_removed,
+         stats->grows, stats->combine_bytes, stats->serialized_bytes,
+         stats->spilled_bytes);
 }
@@ -4,6 +4,22 @@ CREATE OR REPLACE FUNCTION lrtm_count_distinct_append(internal, anyelement)
     AS 'lrtm_count_distinct', 'lrtm_count_distinct_append'
     LANGUAGE C IMMUTABLE;
 
+/* composite keys of 2-4 columns */
+CREATE OR REPLACE FUNCTION lrtm_count_distinct_multi_append(internal, "any", "any")
+    RETURNS internal
+    AS 'lrtm_count_distinct', 'lrtm_count_distinct_multi_append'
+    LANGUAGE C IMMUTABLE;
+
+CREATE OR REPLACE FUNCTION lrtm_count_distinct_multi_append(internal, "any", "any", "any")
+    RETURNS internal
+    AS 'lrtm_count_distinct', 'lrtm_count_distinct_multi_append'
+    LANGUAGE C IMMUTABLE;
+
+CREATE OR REPLACE FUNCTION lrtm_count_distinct_multi_append(internal, "any", "any", "any", "any")
+    RETURNS internal
+    AS 'lrtm_count_distinct', 'lrtm_count_distinct_multi_append'
+    LANGUAGE C IMMUTABLE;
+
 CREATE OR REPLACE FUNCTION lrtm_count_distinct_elements_append(internal, anyarray)
     RETURNS internal
     AS 'lrtm_count_distinct', 'lrtm_count_distinct_elements_append'
@@ -16,7 +32,7 @@ CREATE OR REPLACE FUNCTION lrtm_count_distinct(internal)
 
 CREATE OR REPLACE FUNCTION lrtm_array_agg_distinct(internal, anynonarray)
     RETURNS anyarray
-    AS 'lrtm_count_distinct', 'array_agg_distinct_type_by_element'
+    AS 'lrtm_count_distinct', 'lrtm_array_agg_distinct_type_by_element'
     LANGUAGE C IMMUTABLE;
 
 CREATE OR REPLACE FUNCTION lrtm_array_agg_distinct(internal, anyarray)
@@ -44,6 +60,22 @@ CREATE OR REPLACE FUNCTION lrtm_count_distinct_combine(p_state_1 internal, p_sta
     AS 'lrtm_count_distinct', 'lrtm_count_distinct_combine'
     LANGUAGE C IMMUTABLE;
 
+/* moving-aggregate (window frame) variant, with values counted */
+CREATE OR REPLACE FUNCTION lrtm_count_distinct_moving_append(internal, anyelement)
+    RETURNS internal
+    AS 'lrtm_count_distinct', 'lrtm_count_distinct_moving_append'
+    LANGUAGE C IMMUTABLE;
+
+CREATE OR REPLACE FUNCTION lrtm_count_distinct_moving_remove(internal, anyelement)
+    RETURNS internal
+    AS 'lrtm_count_distinct', 'lrtm_count_distinct_moving_remove'
+    LANGUAGE C IMMUTABLE;
+
+CREATE OR REPLACE FUNCTION lrtm_count_distinct_moving(internal)
+    RETURNS bigint
+    AS 'lrtm_count_distinct', 'lrtm_count_distinct_moving'
+    LANGUAGE C IMMUTABLE;
+
 /* Create the aggregate functions */
 CREATE AGGREGATE lrtm_count_distinct(anyelement) (
        SFUNC = lrtm_count_distinct_append,
@@ -52,6 +84,44 @@ CREATE AGGREGATE lrtm_count_distinct(anyelement) (
        COMBINEFUNC = lrtm_count_distinct_combine,
        SERIALFUNC = lrtm_count_distinct_serial,
        DESERIALFUNC = lrtm_count_distinct_deserial,
+       MSFUNC = lrtm_count_distinct_moving_append,
+       MINVFUNC = lrtm_count_distinct_moving_remove,
+       MSTYPE = internal,
+       MFINALFUNC = lrtm_count_distinct_moving,
+       PARALLEL = SAFE
+);
+
+/*
+ * Distinct combinations of 2-4 columns, like count(DISTINCT (a, b)) but with
+ * rows with a NULL in any of the columns ignored.
+ */
+CREATE AGGREGATE lrtm_count_distinct("any", "any") (
+       SFUNC = lrtm_count_distinct_multi_append,
+       STYPE = internal,
+       FINALFUNC = lrtm_count_distinct,
+       COMBINEFUNC = lrtm_count_distinct_combine,
+       SERIALFUNC = lrtm_count_distinct_serial,
+       DESERIALFUNC = lrtm_count_distinct_deserial,
+       PARALLEL = SAFE
+);
+
+CREATE AGGREGATE lrtm_count_distinct("any", "any", "any") (
+       SFUNC = lrtm_count_distinct_multi_append,
+       STYPE = internal,
+       FINALFUNC = lrtm_count_distinct,
+       COMBINEFUNC = lrtm_count_distinct_combine,
+       SERIALFUNC = lrtm_count_distinct_serial,
+       DESERIALFUNC = lrtm_count_distinct_deserial,
+       PARALLEL = SAFE
+);
+
+CREATE AGGREGATE lrtm_count_distinct("any", "any", "any", "any") (
+       SFUNC = lrtm_count_distinct_multi_append,
+       STYPE = internal,
+       FINALFUNC = lrtm_count_distinct,
+       COMBINEFUNC = lrtm_count_distinct_combine,
+       SERIALFUNC = lrtm_count_distinct_serial,
+       DESERIALFUNC = lrtm_count_distinct_deserial,
        PARALLEL = SAFE
 );
 
@@ -86,4 +156,327 @@ CREATE AGGREGATE lrtm_array_agg_distinct_elements(anyarray) (
        DESERIALFUNC = lrtm_count_distinct_deserial,
        PARALLEL = SAFE
 );
-x`
+
+/* Approximate distinct count (HyperLogLog) */
+
+CREATE OR REPLACE FUNCTION lrtm_count_distinct_approx_append(internal, anyelement)
+    RETURNS internal
+    AS 'lrtm_count_distinct', 'lrtm_count_distinct_approx_append'
+    LANGUAGE C IMMUTABLE;
+
+CREATE OR REPLACE FUNCTION lrtm_count_distinct_approx_append(internal, anyelement, integer)
+    RETURNS internal
+    AS 'lrtm_count_distinct', 'lrtm_count_distinct_approx_append'
+    LANGUAGE C IMMUTABLE;
+
+CREATE OR REPLACE FUNCTION lrtm_count_distinct_approx(internal)
+    RETURNS bigint
+    AS 'lrtm_count_distinct', 'lrtm_count_distinct_approx'
+    LANGUAGE C IMMUTABLE;
+
+CREATE OR REPLACE FUNCTION lrtm_count_distinct_approx_serial(p_pointer internal)
+    RETURNS bytea
+    AS 'lrtm_count_distinct', 'lrtm_count_distinct_approx_serial'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION lrtm_count_distinct_approx_deserial(p_value bytea, p_dummy internal)
+    RETURNS internal
+    AS 'lrtm_count_distinct', 'lrtm_count_distinct_approx_deserial'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION lrtm_count_distinct_approx_combine(p_state_1 internal, p_state_2 internal)
+    RETURNS internal
+    AS 'lrtm_count_distinct', 'lrtm_count_distinct_approx_combine'
+    LANGUAGE C IMMUTABLE;
+
+CREATE AGGREGATE lrtm_count_distinct_approx(anyelement) (
+       SFUNC = lrtm_count_distinct_approx_append,
+       STYPE = internal,
+       FINALFUNC = lrtm_count_distinct_approx,
+       COMBINEFUNC = lrtm_count_distinct_approx_combine,
+       SERIALFUNC = lrtm_count_distinct_approx_serial,
+       DESERIALFUNC = lrtm_count_distinct_approx_deserial,
+       PARALLEL = SAFE
+);
+
+/* precision = number of index bits (4-18), the error is about 1.04 / sqrt(2^precision) */
+CREATE AGGREGATE lrtm_count_distinct_approx(anyelement, integer) (
+       SFUNC = lrtm_count_distinct_approx_append,
+       STYPE = internal,
+       FINALFUNC = lrtm_count_distinct_approx,
+       COMBINEFUNC = lrtm_count_distinct_approx_combine,
+       SERIALFUNC = lrtm_count_distinct_approx_serial,
+       DESERIALFUNC = lrtm_count_distinct_approx_deserial,
+       PARALLEL = SAFE
+);
+
+/* Exact distinct count degrading to a sketch past lrtm_count_distinct.max_exact_bytes */
+
+CREATE TYPE lrtm_count_distinct_result AS (
+    count   bigint,
+    exact   boolean
+);
+
+CREATE OR REPLACE FUNCTION lrtm_count_distinct_hybrid_append(internal, anyelement)
+    RETURNS internal
+    AS 'lrtm_count_distinct', 'lrtm_count_distinct_hybrid_append'
+    LANGUAGE C IMMUTABLE;
+
+CREATE OR REPLACE FUNCTION lrtm_count_distinct_hybrid(internal)
+    RETURNS lrtm_count_distinct_result
+    AS 'lrtm_count_distinct', 'lrtm_count_distinct_hybrid'
+    LANGUAGE C IMMUTABLE;
+
+CREATE AGGREGATE lrtm_count_distinct_hybrid(anyelement) (
+       SFUNC = lrtm_count_distinct_hybrid_append,
+       STYPE = internal,
+       FINALFUNC = lrtm_count_distinct_hybrid,
+       COMBINEFUNC = lrtm_count_distinct_combine,
+       SERIALFUNC = lrtm_count_distinct_serial,
+       DESERIALFUNC = lrtm_count_distinct_deserial,
+       PARALLEL = SAFE
+);
+
+/*
+ * Persistable distinct sets (e.g. for rollup tables), combined by lrtm_distinct_union.
+ * The format is versioned and independent of the byte order, so the sets (and the
+ * partial aggregate states) may be combined on other machines. The sets remember
+ * the type of the values, and sets of different types can't be combined.
+ */
+
+CREATE TYPE lrtm_distinct_set;
+
+CREATE OR REPLACE FUNCTION lrtm_distinct_set_in(cstring)
+    RETURNS lrtm_distinct_set
+    AS 'lrtm_count_distinct', 'lrtm_distinct_set_in'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION lrtm_distinct_set_out(lrtm_distinct_set)
+    RETURNS cstring
+    AS 'lrtm_count_distinct', 'lrtm_distinct_set_out'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION lrtm_distinct_set_recv(internal)
+    RETURNS lrtm_distinct_set
+    AS 'lrtm_count_distinct', 'lrtm_distinct_set_recv'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION lrtm_distinct_set_send(lrtm_distinct_set)
+    RETURNS bytea
+    AS 'lrtm_count_distinct', 'lrtm_distinct_set_send'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE TYPE lrtm_distinct_set (
+       INPUT = lrtm_distinct_set_in,
+       OUTPUT = lrtm_distinct_set_out,
+       RECEIVE = lrtm_distinct_set_recv,
+       SEND = lrtm_distinct_set_send,
+       INTERNALLENGTH = VARIABLE,
+       STORAGE = extended
+);
+
+/* number of distinct values in the set (estimated, if it degraded to a sketch) */
+CREATE OR REPLACE FUNCTION lrtm_distinct_set_cardinality(lrtm_distinct_set)
+    RETURNS bigint
+    AS 'lrtm_count_distinct', 'lrtm_distinct_set_cardinality'
+    LANGUAGE C IMMUTABLE STRICT;
+
+/* the stored set is just the serialized state */
+CREATE OR REPLACE FUNCTION lrtm_distinct_set_final(p_pointer internal)
+    RETURNS lrtm_distinct_set
+    AS 'lrtm_count_distinct', 'lrtm_count_distinct_serial'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION lrtm_distinct_union_append(internal, lrtm_distinct_set)
+    RETURNS internal
+    AS 'lrtm_count_distinct', 'lrtm_distinct_union_append'
+    LANGUAGE C IMMUTABLE;
+
+CREATE AGGREGATE lrtm_distinct_set_agg(anyelement) (
+       SFUNC = lrtm_count_distinct_append,
+       STYPE = internal,
+       FINALFUNC = lrtm_distinct_set_final,
+       COMBINEFUNC = lrtm_count_distinct_combine,
+       SERIALFUNC = lrtm_count_distinct_serial,
+       DESERIALFUNC = lrtm_count_distinct_deserial,
+       PARALLEL = SAFE
+);
+
+CREATE AGGREGATE lrtm_distinct_union(lrtm_distinct_set) (
+       SFUNC = lrtm_distinct_union_append,
+       STYPE = internal,
+       FINALFUNC = lrtm_distinct_set_final,
+       COMBINEFUNC = lrtm_count_distinct_combine,
+       SERIALFUNC = lrtm_count_distinct_serial,
+       DESERIALFUNC = lrtm_count_distinct_deserial,
+       PARALLEL = SAFE
+);
+
+CREATE AGGREGATE lrtm_distinct_union_count(lrtm_distinct_set) (
+       SFUNC = lrtm_distinct_union_append,
+       STYPE = internal,
+       FINALFUNC = lrtm_count_distinct,
+       COMBINEFUNC = lrtm_count_distinct_combine,
+       SERIALFUNC = lrtm_count_distinct_serial,
+       DESERIALFUNC = lrtm_count_distinct_deserial,
+       PARALLEL = SAFE
+);
+
+/* Set algebra on stored sets (counts only, estimated when either set is a sketch) */
+
+CREATE OR REPLACE FUNCTION lrtm_distinct_set_intersect_count(lrtm_distinct_set, lrtm_distinct_set)
+    RETURNS bigint
+    AS 'lrtm_count_distinct', 'lrtm_distinct_set_intersect_count'
+    LANGUAGE C IMMUTABLE STRICT;
+
+/* values in the first set but not in the second one */
+CREATE OR REPLACE FUNCTION lrtm_distinct_set_difference_count(lrtm_distinct_set, lrtm_distinct_set)
+    RETURNS bigint
+    AS 'lrtm_count_distinct', 'lrtm_distinct_set_difference_count'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION lrtm_distinct_set_union_count(lrtm_distinct_set, lrtm_distinct_set)
+    RETURNS bigint
+    AS 'lrtm_count_distinct', 'lrtm_distinct_set_union_count'
+    LANGUAGE C IMMUTABLE STRICT;
+
+/*
+ * Distinct counts of all the groups at once, e.g.
+ *
+ *   SELECT * FROM unnest((SELECT lrtm_count_distinct_grouped(grp, val) FROM t));
+ *
+ * which is cheaper than GROUP BY with lrtm_count_distinct when there
+ * are many small groups. The groups are in no particular order.
+ *
+ * The counts are exact (varlena values are compared by 64-bit hashes, as in
+ * lrtm_count_distinct). Values of fixed-length types wider than 8 bytes and
+ * compared by their bytes (e.g. uuid) are not supported, as the pairs have no
+ * space for them.
+ */
+
+CREATE TYPE lrtm_group_count AS (
+    group_key   bigint,
+    count       bigint
+);
+
+CREATE OR REPLACE FUNCTION lrtm_count_distinct_grouped_append(internal, bigint, anyelement)
+    RETURNS internal
+    AS 'lrtm_count_distinct', 'lrtm_count_distinct_grouped_append'
+    LANGUAGE C IMMUTABLE;
+
+CREATE OR REPLACE FUNCTION lrtm_count_distinct_grouped_serial(p_pointer internal)
+    RETURNS bytea
+    AS 'lrtm_count_distinct', 'lrtm_count_distinct_grouped_serial'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION lrtm_count_distinct_grouped_deserial(p_value bytea, p_dummy internal)
+    RETURNS internal
+    AS 'lrtm_count_distinct', 'lrtm_count_distinct_grouped_deserial'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION lrtm_count_distinct_grouped_combine(p_state_1 internal, p_state_2 internal)
+    RETURNS internal
+    AS 'lrtm_count_distinct', 'lrtm_count_distinct_grouped_combine'
+    LANGUAGE C IMMUTABLE;
+
+CREATE OR REPLACE FUNCTION lrtm_count_distinct_grouped(internal)
+    RETURNS lrtm_group_count[]
+    AS 'lrtm_count_distinct', 'lrtm_count_distinct_grouped'
+    LANGUAGE C IMMUTABLE;
+
+CREATE AGGREGATE lrtm_count_distinct_grouped(bigint, anyelement) (
+       SFUNC = lrtm_count_distinct_grouped_append,
+       STYPE = internal,
+       FINALFUNC = lrtm_count_distinct_grouped,
+       COMBINEFUNC = lrtm_count_distinct_grouped_combine,
+       SERIALFUNC = lrtm_count_distinct_grouped_serial,
+       DESERIALFUNC = lrtm_count_distinct_grouped_deserial,
+       PARALLEL = SAFE
+);
+
+/*
+ * The k most frequent values (most frequent first, smaller values first on ties),
+ * and their counts. Both aggregates use the same transition, so with the same
+ * arguments they share the state, e.g.
+ *
+ *   SELECT grp, lrtm_top_k(val, 10), lrtm_top_k_counts(val, 10), lrtm_count_distinct(val)
+ *     FROM t GROUP BY grp;
+ *
+ * All the distinct values are counted exactly. Values of varlena types are kept
+ * only as hashes, so lrtm_top_k can't return them (lrtm_top_k_counts still works).
+ */
+
+CREATE OR REPLACE FUNCTION lrtm_top_k_append(internal, anyelement, integer)
+    RETURNS internal
+    AS 'lrtm_count_distinct', 'lrtm_top_k_append'
+    LANGUAGE C IMMUTABLE;
+
+CREATE OR REPLACE FUNCTION lrtm_top_k_serial(p_pointer internal)
+    RETURNS bytea
+    AS 'lrtm_count_distinct', 'lrtm_top_k_serial'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION lrtm_top_k_deserial(p_value bytea, p_dummy internal)
+    RETURNS internal
+    AS 'lrtm_count_distinct', 'lrtm_top_k_deserial'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION lrtm_top_k_combine(p_state_1 internal, p_state_2 internal)
+    RETURNS internal
+    AS 'lrtm_count_distinct', 'lrtm_top_k_combine'
+    LANGUAGE C IMMUTABLE;
+
+CREATE OR REPLACE FUNCTION lrtm_top_k(internal, anyelement, integer)
+    RETURNS anyarray
+    AS 'lrtm_count_distinct', 'lrtm_top_k'
+    LANGUAGE C IMMUTABLE;
+
+CREATE OR REPLACE FUNCTION lrtm_top_k_counts(internal, anyelement, integer)
+    RETURNS bigint[]
+    AS 'lrtm_count_distinct', 'lrtm_top_k_counts'
+    LANGUAGE C IMMUTABLE;
+
+CREATE AGGREGATE lrtm_top_k(anyelement, integer) (
+       SFUNC = lrtm_top_k_append,
+       STYPE = internal,
+       FINALFUNC = lrtm_top_k,
+       FINALFUNC_EXTRA,
+       COMBINEFUNC = lrtm_top_k_combine,
+       SERIALFUNC = lrtm_top_k_serial,
+       DESERIALFUNC = lrtm_top_k_deserial,
+       PARALLEL = SAFE
+);
+
+CREATE AGGREGATE lrtm_top_k_counts(anyelement, integer) (
+       SFUNC = lrtm_top_k_append,
+       STYPE = internal,
+       FINALFUNC = lrtm_top_k_counts,
+       FINALFUNC_EXTRA,
+       COMBINEFUNC = lrtm_top_k_combine,
+       SERIALFUNC = lrtm_top_k_serial,
+       DESERIALFUNC = lrtm_top_k_deserial,
+       PARALLEL = SAFE
+);
+
+/*
+ * Statistics of the sets (collected with lrtm_count_distinct.track_stats), for this backend.
+ * peak_context_bytes is the largest aggregate memory context seen by a final function.
+ */
+
+CREATE OR REPLACE FUNCTION lrtm_count_distinct_stats(
+    OUT sets bigint,
+    OUT compactions bigint,
+    OUT items_sorted bigint,
+    OUT dups_removed bigint,
+    OUT grows bigint,
+    OUT combine_bytes bigint,
+    OUT serialized_bytes bigint,
+    OUT spilled_bytes bigint,
+    OUT peak_context_bytes bigint)
+    AS 'lrtm_count_distinct', 'lrtm_count_distinct_stats'
+    LANGUAGE C VOLATILE;
+
+CREATE OR REPLACE FUNCTION lrtm_count_distinct_stats_reset()
+    RETURNS void
+    AS 'lrtm_count_distinct', 'lrtm_count_distinct_stats_reset'
+    LANGUAGE C VOLATILE;
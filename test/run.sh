@@ -0,0 +1,36 @@
+#!/bin/sh
+#
+# Regression tests of the lrtm_count_distinct extension. Connects using the
+# usual libpq environment (PGDATABASE, PGHOST, ...), the extension SQL needs
+# to be loaded in the database.
+#
+#   test/run.sh [test ...]
+#
+# Runs test/sql/<test>.sql (all of them by default) the way pg_regress does,
+# and compares the output with test/expected/<test>.out. The output of the
+# failed tests is kept in test/results/.
+
+DIR=$(dirname "$0")
+PSQL="psql -X -a -q"
+
+if [ $# -eq 0 ]; then
+    set -- $(ls "$DIR/sql" | sed 's/\.sql$//')
+fi
+
+mkdir -p "$DIR/results"
+
+failed=0
+
+for test in "$@"; do
+    $PSQL < "$DIR/sql/$test.sql" > "$DIR/results/$test.out" 2>&1
+
+    if diff -u "$DIR/expected/$test.out" "$DIR/results/$test.out"; then
+        echo "ok   $test"
+        rm -f "$DIR/results/$test.out"
+    else
+        echo "FAIL $test"
+        failed=1
+    fi
+done
+
+exit $failed
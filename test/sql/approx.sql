@@ -0,0 +1,7 @@
+--
+-- lrtm_count_distinct_approx only hashes the values, so it accepts types the
+-- exact sets can't store (point has neither a hash function nor equalimage).
+--
+SELECT lrtm_count_distinct_approx(point(x % 10, 0)) BETWEEN 9 AND 11 AS ok
+  FROM generate_series(1, 1000) x;
+SELECT lrtm_count_distinct(point(x % 10, 0)) FROM generate_series(1, 1000) x;
@@ -0,0 +1,10 @@
+--
+-- lrtm_count_distinct_grouped gives exact counts, so values that would only
+-- fit into the pairs as hashes are rejected.
+--
+SELECT * FROM unnest((SELECT lrtm_count_distinct_grouped(x % 3, x % 5)
+                        FROM generate_series(1, 30) x))
+ ORDER BY group_key;
+SELECT lrtm_count_distinct_grouped(x % 3, md5(x::text)::uuid) FROM generate_series(1, 30) x;
+SELECT x % 3 AS g, lrtm_count_distinct(md5(x::text)::uuid) FROM generate_series(1, 30) x
+ GROUP BY 1 ORDER BY 1;
@@ -0,0 +1,45 @@
+--
+-- Stored lrtm_distinct_set values (see set_header_t). The literals are sets
+-- in the current and in the older format, and have to stay readable as they
+-- are:
+--
+--   A1 - int8 values {-10000000000, -5, 1, 7, 100, 1000, 65536, 1000000,
+--        1000000000, 1000000000000}, delta-encoded, version 1 (the native
+--        header, written on a little-endian machine)
+--   A2 - the same set, version 2
+--   B2 - int8 values {1, 42, 100, 65536, 123456789, 1000000000000}, version 2
+--   C2 - int4 values 1 .. 100 as a bitmap, version 2
+--
+
+-- cardinalities
+SELECT lrtm_distinct_set_cardinality('01000100080064010a0000000000000080b8d0dfdaffffff7ffac7afa02505055c830797f803bf8439bf8faedc03ff8ba9c8891d') AS a1,
+       lrtm_distinct_set_cardinality('02000100080064010a000000000000001400000080b8d0dfdaffffff7ffac7afa02505055c830797f803bf8439bf8faedc03ff8ba9c8891d') AS a2,
+       lrtm_distinct_set_cardinality('02000100080064010600000000000000140000008180808080808080800128399bff03949aeb3aea85a5ea8c1d') AS b2,
+       lrtm_distinct_set_cardinality('02030000040069016400000000000000170000000000008000000000feffffffffffffffffffffff1f000000') AS c2;
+
+-- version 1 and version 2 sets combined
+SELECT lrtm_distinct_set_intersect_count('01000100080064010a0000000000000080b8d0dfdaffffff7ffac7afa02505055c830797f803bf8439bf8faedc03ff8ba9c8891d', '02000100080064010a000000000000001400000080b8d0dfdaffffff7ffac7afa02505055c830797f803bf8439bf8faedc03ff8ba9c8891d') AS intersect_count;
+
+SELECT lrtm_distinct_set_intersect_count('01000100080064010a0000000000000080b8d0dfdaffffff7ffac7afa02505055c830797f803bf8439bf8faedc03ff8ba9c8891d', '02000100080064010600000000000000140000008180808080808080800128399bff03949aeb3aea85a5ea8c1d') AS intersect_count,
+       lrtm_distinct_set_difference_count('01000100080064010a0000000000000080b8d0dfdaffffff7ffac7afa02505055c830797f803bf8439bf8faedc03ff8ba9c8891d', '02000100080064010600000000000000140000008180808080808080800128399bff03949aeb3aea85a5ea8c1d') AS difference_count,
+       lrtm_distinct_set_union_count('01000100080064010a0000000000000080b8d0dfdaffffff7ffac7afa02505055c830797f803bf8439bf8faedc03ff8ba9c8891d', '02000100080064010600000000000000140000008180808080808080800128399bff03949aeb3aea85a5ea8c1d') AS union_count;
+
+SELECT lrtm_distinct_union_count(s) AS union_count
+  FROM (VALUES ('01000100080064010a0000000000000080b8d0dfdaffffff7ffac7afa02505055c830797f803bf8439bf8faedc03ff8ba9c8891d'::lrtm_distinct_set), ('02000100080064010600000000000000140000008180808080808080800128399bff03949aeb3aea85a5ea8c1d')) t(s);
+
+-- the text form is the stored data in hex
+SELECT '02000100080064010a000000000000001400000080b8d0dfdaffffff7ffac7afa02505055c830797f803bf8439bf8faedc03ff8ba9c8891d'::lrtm_distinct_set::text = '02000100080064010a000000000000001400000080b8d0dfdaffffff7ffac7afa02505055c830797f803bf8439bf8faedc03ff8ba9c8891d' AS round_trip;
+
+-- sets built now are encoded the same way (on any machine)
+SELECT lrtm_distinct_set_agg(x)::text = '02000100080064010a000000000000001400000080b8d0dfdaffffff7ffac7afa02505055c830797f803bf8439bf8faedc03ff8ba9c8891d' AS same_bytes
+  FROM unnest('{-10000000000,-5,1,7,100,1000,65536,1000000,1000000000,1000000000000}'::int8[]) x;
+
+SELECT lrtm_distinct_set_union_count('02030000040069016400000000000000170000000000008000000000feffffffffffffffffffffff1f000000', lrtm_distinct_set_agg(x)) AS union_count
+  FROM generate_series(51, 150) x;
+
+-- sets of different types (even with the same item size) can't be combined
+SELECT lrtm_distinct_set_intersect_count('02000100080064010a000000000000001400000080b8d0dfdaffffff7ffac7afa02505055c830797f803bf8439bf8faedc03ff8ba9c8891d', lrtm_distinct_set_agg(x)) AS intersect_count
+  FROM generate_series(1, 10) x;
+
+SELECT lrtm_distinct_set_intersect_count('02030000040069016400000000000000170000000000008000000000feffffffffffffffffffffff1f000000', lrtm_distinct_set_agg(date '2000-01-01' + x)) AS intersect_count
+  FROM generate_series(1, 10) x;
@@ -0,0 +1,42 @@
+--
+-- Sets spilled to temporary files by an aborted (sub)transaction. The files
+-- are closed by the resource owner, so there must be no warnings about
+-- temporary file leaks (or errors about invalid files) afterwards.
+--
+SET lrtm_count_distinct.spill_bytes = '64kB';
+SET lrtm_count_distinct.track_stats = on;
+SET max_parallel_workers_per_gather = 0;
+SELECT lrtm_count_distinct_stats_reset();
+
+-- savepoint
+BEGIN;
+SAVEPOINT s;
+SELECT lrtm_count_distinct(x::int8 * 1000003) FROM generate_series(1, 200000) x
+ WHERE 1 / (200000 - x) >= 0;
+ROLLBACK TO SAVEPOINT s;
+SELECT lrtm_count_distinct(x::int8 * 1000003) FROM generate_series(1, 200000) x;
+COMMIT;
+
+-- exception block in plpgsql
+DO $$
+BEGIN
+    PERFORM lrtm_count_distinct(x::int8 * 1000003) FROM generate_series(1, 200000) x
+      WHERE 1 / (200000 - x) >= 0;
+EXCEPTION WHEN division_by_zero THEN
+    RAISE NOTICE 'aborted';
+END;
+$$;
+
+-- the whole transaction
+BEGIN;
+SELECT lrtm_count_distinct(x::int8 * 1000003) FROM generate_series(1, 200000) x
+ WHERE 1 / (200000 - x) >= 0;
+ROLLBACK;
+
+SELECT lrtm_count_distinct(x::int8 * 1000003) FROM generate_series(1, 200000) x;
+
+SELECT spilled_bytes > 0 AS spilled FROM lrtm_count_distinct_stats();
+
+RESET lrtm_count_distinct.spill_bytes;
+RESET lrtm_count_distinct.track_stats;
+RESET max_parallel_workers_per_gather;